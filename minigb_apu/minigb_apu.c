@@ -5,6 +5,7 @@
  * project is based on MiniGBS by Alex Baines: https://github.com/baines/MiniGBS
  */
 
+#include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
@@ -24,31 +25,130 @@
 #define VOL_INIT_MAX		(INT16_MAX/8)
 #define VOL_INIT_MIN		(INT16_MIN/8)
 
-/* Handles time keeping for sound generation.
- * FREQ_INC_REF must be equal to, or larger than AUDIO_SAMPLE_RATE in order
- * to avoid a division by zero error.
- * Using a square of 2 simplifies calculations. */
-#define FREQ_INC_REF		(AUDIO_SAMPLE_RATE * 16)
-
 #define MAX_CHAN_VOLUME		15
 
+/* Band-limited synthesis. Each change in the output of a channel is added to a
+ * buffer as a band-limited step at the time it happens, and the buffer is only
+ * summed once per sample. Times are in samples, with BLIP_FRAC_BITS fractional
+ * bits. */
+#define BLIP_FRAC_BITS		16
+#define BLIP_PHASE_BITS		5
+#define BLIP_PHASES		(1 << BLIP_PHASE_BITS)
+/* Taps of a step, which delays it by BLIP_WIDTH / 2 - 1 samples. */
+#define BLIP_WIDTH		16
+#define BLIP_KERNEL_BITS	15
+/* Most samples rendered at once. */
+#define BLIP_SAMPLES		256
+
+/* Time of a number of cycles, rounded down. A cycle is 689.0625 time units, so
+ * only multiples of 16 cycles are exact, such as SEQ_PERIOD. Channel periods
+ * are at most 1/11000 short, which raises the pitch by under 0.2 cents. */
+#define CYCLES_TO_TIME(cycles)	\
+	((uint32_t)(((uint64_t)(cycles) * AUDIO_SAMPLE_RATE << BLIP_FRAC_BITS) / DMG_CLOCK_FREQ_U))
+
+/* The frame sequencer steps at 512 Hz. It clocks the length counters on even
+ * steps, the sweep on steps 2 and 6, and the envelopes on step 7. */
+#define SEQ_PERIOD		CYCLES_TO_TIME(DMG_CLOCK_FREQ_U / 512)
+
+/* Number of register writes that may wait to be played. Must be a power of 2. */
+#define AUDIO_QUEUE_SIZE	2048
+
+/* Cycles the audio callback plays behind the emulator, so that the writes of a
+ * frame are queued before they are played. When the writes are further ahead
+ * than AUDIO_LATENCY_MAX, or behind, the callback catches up with them. */
+#define AUDIO_LATENCY		((uint32_t)(SCREEN_REFRESH_CYCLES * 3 / 2))
+#define AUDIO_LATENCY_MAX	((uint32_t)(SCREEN_REFRESH_CYCLES * 3))
+
+/* Samples rendered by audio_frame() that may wait for the callback. Must be a
+ * power of 2. The callback starts playing once AUDIO_RING_LATENCY samples are
+ * waiting, and skips ahead to that when more than AUDIO_RING_LATENCY_MAX are. */
+#define AUDIO_RING_SIZE		4096
+#define AUDIO_RING_LATENCY	(AUDIO_SAMPLES * 2)
+#define AUDIO_RING_LATENCY_MAX	(AUDIO_SAMPLES * 4)
+
+/* The callback reads the ring up to 0.5% faster or slower than it plays, in
+ * 1/65536, to keep AUDIO_RING_LATENCY samples waiting, reaching it a frame of
+ * samples away. The samples waiting are averaged over 2^AUDIO_LEVEL_SHIFT
+ * callbacks, as the emulator adds a frame of samples at once. */
+#define AUDIO_RATE_ADJUST	328
+#define AUDIO_LEVEL_SHIFT	5
+
 /**
- * Memory holding audio registers between 0xFF10 and 0xFF3F inclusive.
+ * Memory holding audio registers between 0xFF10 and 0xFF3F inclusive, as
+ * played by the audio callback.
  */
 static uint8_t audio_mem[AUDIO_MEM_SIZE];
 
+/**
+ * Audio registers as seen by the emulator. They are written at once, while
+ * audio_mem follows them as the queued writes are played.
+ */
+static uint8_t audio_regs[AUDIO_MEM_SIZE];
+
+/**
+ * Channel status bits of NR52 in audio_mem, as played. Only written by the
+ * side playing the writes, and read by audio_read().
+ */
+static uint8_t audio_status;
+
+/**
+ * Register writes waiting to be played. The emulator only writes the tail, and
+ * the audio callback only writes the head, so neither side needs a lock.
+ */
+static struct audio_queue_entry {
+	uint32_t cycle;
+	uint8_t addr;	/* Offset from AUDIO_ADDR_COMPENSATION */
+	uint8_t val;
+} audio_queue[AUDIO_QUEUE_SIZE];
+
+static uint32_t audio_queue_head;
+static uint32_t audio_queue_tail;
+
+/* Clock of the next sample played, and the remainder in
+ * 1/AUDIO_SAMPLE_RATE of a cycle. */
+static uint32_t audio_clock;
+static uint32_t audio_clock_rem;
+
+#if AUDIO_RENDER_IN_FRAME
+/**
+ * Samples rendered by audio_frame(), waiting for the audio callback. As for
+ * the queue, each side only writes its own index.
+ */
+static int16_t audio_ring[2][AUDIO_RING_SIZE];
+static uint32_t audio_ring_head;
+static uint32_t audio_ring_tail;
+
+/* Cleared when the callback ran out of samples. */
+static bool audio_ring_playing;
+
+/* Position of the callback between the samples at head and head + 1, and the
+ * samples it reads per sample played, in 1/65536. */
+static uint32_t audio_ring_frac;
+static uint32_t audio_ring_step;
+
+/* Samples waiting for the callback, in 1/2^AUDIO_LEVEL_SHIFT. */
+static uint32_t audio_ring_level;
+
+/* Counted by the callback, and the samples dropped by each side. Each
+ * counter is only written by one side. */
+static uint32_t audio_underruns;
+static uint32_t audio_dropped;
+static uint32_t audio_skipped;
+#endif
+
+/* Counters are clocked by the frame sequencer, and count down to 0. */
 struct chan_len_ctr {
 	uint8_t load;
 	unsigned enabled : 1;
-	uint32_t counter;
-	uint32_t inc;
+	uint16_t counter;
 };
 
 struct chan_vol_env {
 	uint8_t step;
 	unsigned up : 1;
-	uint32_t counter;
-	uint32_t inc;
+	/* Cleared once the volume reached 0 or the maximum. */
+	unsigned active : 1;
+	uint8_t counter;
 };
 
 struct chan_freq_sweep {
@@ -56,8 +156,7 @@ struct chan_freq_sweep {
 	uint8_t rate;
 	uint8_t shift;
 	unsigned up : 1;
-	uint32_t counter;
-	uint32_t inc;
+	uint8_t counter;
 };
 
 static struct chan {
@@ -71,11 +170,17 @@ static struct chan {
 	uint8_t volume_init;
 
 	uint16_t freq;
-	uint32_t freq_counter;
-	uint32_t freq_inc;
+
+	/* Time of a step of the waveform, and of the next step from the start
+	 * of the samples being rendered. */
+	uint32_t period;
+	uint32_t timer;
 
 	int_fast16_t val;
 
+	/* Output added to the left and right buffers so far. */
+	int32_t amp[2];
+
 	struct chan_len_ctr    len;
 	struct chan_vol_env    env;
 	struct chan_freq_sweep sweep;
@@ -90,18 +195,117 @@ static struct chan {
 			uint8_t  lfsr_wide;
 			uint8_t  lfsr_div;
 		} noise;
-		struct {
-			uint8_t sample;
-		} wave;
 	};
 } chans[4];
 
 static int32_t vol_l, vol_r;
 
-static void set_note_freq(struct chan *c, const uint32_t freq)
+/* Band-limited impulse for each phase of a sample. The taps of each phase add
+ * up to 1 << BLIP_KERNEL_BITS, so that steps are summed back exactly. */
+static int16_t blip_kernel[BLIP_PHASES][BLIP_WIDTH];
+static bool blip_kernel_done = false;
+
+/* Steps added to the left and right output, and their sum up to the first
+ * sample of the buffer. */
+static int32_t blip_buf[2][BLIP_SAMPLES + BLIP_WIDTH];
+static int32_t blip_sum[2];
+
+/* Time of the next step of the frame sequencer, from the start of the samples
+ * being rendered, and its number. */
+static uint32_t seq_timer;
+static uint8_t seq_step;
+
+static void blip_init(void)
+{
+	if (blip_kernel_done)
+		return;
+
+	blip_kernel_done = true;
+
+	const float pi = 3.14159265f;
+	/* Cut off a little below half the sample rate. */
+	const float cutoff = 0.9f;
+
+	for (int p = 0; p < BLIP_PHASES; p++) {
+		float taps[BLIP_WIDTH];
+		float total = 0;
+
+		for (int k = 0; k < BLIP_WIDTH; k++) {
+			float x = k - (BLIP_WIDTH / 2 - 1) - (float)p / BLIP_PHASES;
+			float w = x * pi / (BLIP_WIDTH / 2);
+			float window = 0.42f + 0.5f * cosf(w) + 0.08f * cosf(2 * w);
+			float sinc = (x == 0) ? 1 : sinf(pi * cutoff * x) / (pi * cutoff * x);
+
+			taps[k] = sinc * window;
+			total += taps[k];
+		}
+
+		int sum = 0;
+		int peak = 0;
+
+		for (int k = 0; k < BLIP_WIDTH; k++) {
+			blip_kernel[p][k] = (int16_t)lrintf(taps[k] / total * (1 << BLIP_KERNEL_BITS));
+			sum += blip_kernel[p][k];
+
+			if (blip_kernel[p][k] > blip_kernel[p][peak])
+				peak = k;
+		}
+
+		blip_kernel[p][peak] += (1 << BLIP_KERNEL_BITS) - sum;
+	}
+}
+
+/**
+ * Add a step of delta to the output of side at time.
+ * \param fast	Use a step that is only interpolated between two samples, for
+ *				channels changing many times a sample.
+ */
+static void blip_add(const int side, const uint32_t time, const int32_t delta, const bool fast)
+{
+	int32_t *buf = &blip_buf[side][time >> BLIP_FRAC_BITS];
+
+	if (fast) {
+		const int32_t frac = (time >> (BLIP_FRAC_BITS - BLIP_KERNEL_BITS)) &
+			((1 << BLIP_KERNEL_BITS) - 1);
+		const int32_t next = delta * frac;
+
+		buf[BLIP_WIDTH / 2 - 1] += (delta << BLIP_KERNEL_BITS) - next;
+		buf[BLIP_WIDTH / 2] += next;
+		return;
+	}
+
+	const int16_t *kernel = blip_kernel[(time >> (BLIP_FRAC_BITS - BLIP_PHASE_BITS)) &
+		(BLIP_PHASES - 1)];
+
+	for (int k = 0; k < BLIP_WIDTH; k++)
+		buf[k] += kernel[k] * delta;
+}
+
+/**
+ * Add len samples of the summed steps to left and right.
+ */
+static void blip_read(int16_t *left, int16_t *right, const int len)
 {
-	/* Lowest expected value of freq is 64. */
-	c->freq_inc = freq * (uint32_t)(FREQ_INC_REF / AUDIO_SAMPLE_RATE);
+	int16_t *out[2] = { left, right };
+
+	for (int side = 0; side < 2; side++) {
+		int32_t *buf = blip_buf[side];
+		int32_t sum = blip_sum[side];
+
+		for (int i = 0; i < len; i++) {
+			sum += buf[i];
+
+			/* Band-limited steps overshoot a little. */
+			int32_t sample = out[side][i] + (sum >> BLIP_KERNEL_BITS);
+			out[side][i] = MAX(INT16_MIN, MIN(INT16_MAX, sample));
+		}
+
+		blip_sum[side] = sum;
+
+		/* Keep the steps past the samples read. */
+		memmove(buf, buf + len, BLIP_WIDTH * sizeof(buf[0]));
+		memset(buf + BLIP_WIDTH, 0, len * sizeof(buf[0]));
+	}
 }
 
 static void chan_enable(const uint_fast8_t i, const bool enable)
@@ -115,22 +319,20 @@ static void chan_enable(const uint_fast8_t i, const bool enable)
 
 	audio_mem[0xFF26 - AUDIO_ADDR_COMPENSATION] = val;
 	//audio_mem[0xFF26 - AUDIO_ADDR_COMPENSATION] |= 0x80 | ((uint8_t)enable) << i;
+	__atomic_store_n(&audio_status, val & 0x0F, __ATOMIC_RELEASE);
 }
 
 static void update_env(struct chan *c)
 {
-	c->env.counter += c->env.inc;
+	if (!c->env.active || !c->env.step || --c->env.counter)
+		return;
 
-	while (c->env.counter > FREQ_INC_REF) {
-		if (c->env.step) {
-			c->volume += c->env.up ? 1 : -1;
-			if (c->volume == 0 || c->volume == MAX_CHAN_VOLUME) {
-				c->env.inc = 0;
-			}
-			c->volume = MAX(0, MIN(MAX_CHAN_VOLUME, c->volume));
-		}
-		c->env.counter -= FREQ_INC_REF;
+	c->env.counter = c->env.step;
+	c->volume += c->env.up ? 1 : -1;
+	if (c->volume == 0 || c->volume == MAX_CHAN_VOLUME) {
+		c->env.active = 0;
 	}
+	c->volume = MAX(0, MIN(MAX_CHAN_VOLUME, c->volume));
 }
 
 static void update_len(struct chan *c)
@@ -138,33 +340,19 @@ static void update_len(struct chan *c)
 	if (!c->len.enabled)
 		return;
 
-	c->len.counter += c->len.inc;
-	if (c->len.counter > FREQ_INC_REF) {
+	if (--c->len.counter == 0) {
 		chan_enable(c - chans, 0);
-		c->len.counter = 0;
-	}
-}
-
-static bool update_freq(struct chan *c, uint32_t *pos)
-{
-	uint32_t inc = c->freq_inc - *pos;
-	c->freq_counter += inc;
-
-	if (c->freq_counter > FREQ_INC_REF) {
-		*pos		= c->freq_inc - (c->freq_counter - FREQ_INC_REF);
-		c->freq_counter = 0;
-		return true;
-	} else {
-		*pos = c->freq_inc;
-		return false;
 	}
 }
 
 static void update_sweep(struct chan *c)
 {
-	c->sweep.counter += c->sweep.inc;
+	if (!c->sweep.rate || --c->sweep.counter)
+		return;
 
-	while (c->sweep.counter > FREQ_INC_REF) {
+	c->sweep.counter = c->sweep.rate;
+
+	{
 		if (c->sweep.shift) {
 			uint16_t inc = (c->sweep.freq >> c->sweep.shift);
 			if (!c->sweep.up)
@@ -174,60 +362,11 @@ static void update_sweep(struct chan *c)
 			if (c->freq > 2047) {
 				c->enabled = 0;
 			} else {
-				set_note_freq(c,
-					DMG_CLOCK_FREQ_U / ((2048 - c->freq)<< 5));
-				c->freq_inc *= 8;
+				c->period = CYCLES_TO_TIME((2048 - c->freq) * 4);
 			}
-		} else if (c->sweep.rate) {
+		} else {
 			c->enabled = 0;
 		}
-		c->sweep.counter -= FREQ_INC_REF;
-	}
-}
-
-static void update_square(int16_t *left, int16_t *right, const bool ch2, int len)
-{
-	struct chan* c = chans + ch2;
-
-	if (!c->powered || !c->enabled)
-		return;
-
-    uint32_t freq = DMG_CLOCK_FREQ_U / ((2048 - c->freq) << 5);
-	set_note_freq(c, freq);
-	c->freq_inc *= 8;
-    
-	for (uint_fast16_t i = 0; i < len; i++) {
-		update_len(c);
-
-		if (!c->enabled)
-			continue;
-
-		update_env(c);
-		if (!ch2)
-			update_sweep(c);
-
-		uint32_t pos = 0;
-		uint32_t prev_pos = 0;
-		int32_t sample = 0;
-
-		while (update_freq(c, &pos)) {
-			c->square.duty_counter = (c->square.duty_counter + 1) & 7;
-			sample += ((pos - prev_pos) / c->freq_inc) * c->val;
-			c->val = (c->square.duty & (1 << c->square.duty_counter)) ?
-				VOL_INIT_MAX / MAX_CHAN_VOLUME :
-				VOL_INIT_MIN / MAX_CHAN_VOLUME;
-			prev_pos = pos;
-		}
-
-		if (c->muted)
-			continue;
-
-		sample += c->val;
-		sample *= c->volume;
-		sample /= 4;
-
-        left[i] += sample * c->on_left * vol_l;
-        right[i] += sample * c->on_right * vol_r;
 	}
 }
 
@@ -244,120 +383,159 @@ static uint8_t wave_sample(const unsigned int pos, const unsigned int volume)
 	return volume ? (sample >> (volume - 1)) : 0;
 }
 
-static void update_wave(int16_t *left, int16_t *right, int len)
+/**
+ * Output of a channel before panning and master volume.
+ */
+static int32_t chan_level(const struct chan *c)
 {
-	struct chan *c = chans + 2;
+	if (!c->powered || !c->enabled || c->muted)
+		return 0;
 
-	if (!c->powered || !c->enabled)
-		return;
-
-    uint32_t freq = (DMG_CLOCK_FREQ_U / 64) / (2048 - c->freq);
-    set_note_freq(c, freq);
-	c->freq_inc *= 32;
+	if (c == chans + 2) {
+		/* First element is unused. */
+		static const int16_t div[] = { INT16_MAX, 1, 2, 4 };
 
-	for (uint_fast16_t i = 0; i < len; i++) {
-		update_len(c);
+		if (c->volume == 0)
+			return 0;
 
-		if (!c->enabled)
-			continue;
+		return ((int32_t)wave_sample(c->val, c->volume) - 8) *
+			(INT16_MAX/64) / div[c->volume] / 4;
+	}
 
-		uint32_t pos      = 0;
-		uint32_t prev_pos = 0;
-		int32_t sample   = 0;
+	return c->val * c->volume / 4;
+}
 
-		c->wave.sample = wave_sample(c->val, c->volume);
+/**
+ * Add a step at time if the output of a channel changed.
+ */
+static void chan_output(struct chan *c, const uint32_t time, const bool fast)
+{
+	const int32_t level = chan_level(c);
+	const int32_t out[2] = {
+		level * c->on_left * vol_l,
+		level * c->on_right * vol_r
+	};
 
-		while (update_freq(c, &pos)) {
-			c->val = (c->val + 1) & 31;
-			sample += ((pos - prev_pos) / c->freq_inc) *
-				((int)c->wave.sample - 8) * (INT16_MAX/64);
-			c->wave.sample = wave_sample(c->val, c->volume);
-			prev_pos  = pos;
+	for (int side = 0; side < 2; side++) {
+		if (out[side] != c->amp[side]) {
+			blip_add(side, time, out[side] - c->amp[side], fast);
+			c->amp[side] = out[side];
 		}
+	}
+}
 
-		sample += ((int)c->wave.sample - 8) * (int)(INT16_MAX/64);
-
-		if (c->volume == 0)
-			continue;
-
-		{
-			/* First element is unused. */
-            static const int16_t div[] = { INT16_MAX, 1, 2, 4 };
-			sample = sample / (div[c->volume]);
-		}
+/**
+ * Step the waveform of a channel.
+ */
+static void chan_step(struct chan *c)
+{
+	switch (c - chans) {
+	case 0:
+	case 1:
+		c->square.duty_counter = (c->square.duty_counter + 1) & 7;
+		c->val = (c->square.duty & (1 << c->square.duty_counter)) ?
+			VOL_INIT_MAX / MAX_CHAN_VOLUME :
+			VOL_INIT_MIN / MAX_CHAN_VOLUME;
+		break;
 
-		if (c->muted)
-			continue;
+	case 2:
+		c->val = (c->val + 1) & 31;
+		break;
 
-		sample /= 4;
+	case 3:
+		c->noise.lfsr_reg = (c->noise.lfsr_reg << 1) |
+			(c->val >= VOL_INIT_MAX/MAX_CHAN_VOLUME);
 
-        left[i] += sample * c->on_left * vol_l;
-        right[i] += sample * c->on_right * vol_r;
+		if (c->noise.lfsr_wide) {
+			c->val = !(((c->noise.lfsr_reg >> 14) & 1) ^
+					((c->noise.lfsr_reg >> 13) & 1)) ?
+				VOL_INIT_MAX / MAX_CHAN_VOLUME :
+				VOL_INIT_MIN / MAX_CHAN_VOLUME;
+		} else {
+			c->val = !(((c->noise.lfsr_reg >> 6) & 1) ^
+					((c->noise.lfsr_reg >> 5) & 1)) ?
+				VOL_INIT_MAX / MAX_CHAN_VOLUME :
+				VOL_INIT_MIN / MAX_CHAN_VOLUME;
+		}
+		break;
 	}
 }
 
-static void update_noise(int16_t *left, int16_t *right, int len)
+/**
+ * Find the period of a channel from its registers.
+ */
+static void chan_update_period(const uint_fast8_t i)
 {
-	struct chan *c = chans + 3;
+	struct chan *c = chans + i;
 
-	if (!c->powered)
-		return;
+	switch (i) {
+	case 0:
+	case 1:
+		c->period = CYCLES_TO_TIME((2048 - c->freq) * 4);
+		break;
 
-	{
+	case 2:
+		c->period = CYCLES_TO_TIME((2048 - c->freq) * 2);
+		break;
+
+	case 3: {
 		static const uint32_t lfsr_div_lut[] = {
 			8, 16, 32, 48, 64, 80, 96, 112
 		};
-		uint32_t freq;
-
-		freq = DMG_CLOCK_FREQ_U / (lfsr_div_lut[c->noise.lfsr_div] << c->freq);
-		set_note_freq(c, freq);
-	}
 
-	if (c->freq >= 14)
-		c->enabled = 0;
+		if (c->freq >= 14)
+			c->enabled = 0;
 
-	for (uint_fast16_t i = 0; i < len; i++) {
-		update_len(c);
+		c->period = CYCLES_TO_TIME(lfsr_div_lut[c->noise.lfsr_div] << c->freq);
+		break;
+	}
+	}
+}
 
-		if (!c->enabled)
-			continue;
+/**
+ * Step the waveform of a channel up to end, adding a step wherever its output
+ * changes. Nothing else about the channel changes until end.
+ */
+static void chan_run(struct chan *c, const uint32_t end)
+{
+	if (!c->powered || !c->enabled)
+		return;
 
-		update_env(c);
+	/* Steps closer than a sample are above what can be heard, so they need
+	 * not be band-limited. */
+	const bool fast = (c->period < (1 << BLIP_FRAC_BITS));
 
-		uint32_t pos      = 0;
-		uint32_t prev_pos = 0;
-		int32_t sample    = 0;
+	while (c->timer < end) {
+		chan_step(c);
+		chan_output(c, c->timer, fast);
+		c->timer += c->period;
+	}
+}
 
-		while (update_freq(c, &pos)) {
-			c->noise.lfsr_reg = (c->noise.lfsr_reg << 1) |
-				(c->val >= VOL_INIT_MAX/MAX_CHAN_VOLUME);
+/**
+ * Step the frame sequencer, at time.
+ */
+static void seq_clock(const uint32_t time)
+{
+	for (uint_fast8_t i = 0; i < 4; i++) {
+		struct chan *c = chans + i;
 
-			if (c->noise.lfsr_wide) {
-				c->val = !(((c->noise.lfsr_reg >> 14) & 1) ^
-						((c->noise.lfsr_reg >> 13) & 1)) ?
-					VOL_INIT_MAX / MAX_CHAN_VOLUME :
-					VOL_INIT_MIN / MAX_CHAN_VOLUME;
-			} else {
-				c->val = !(((c->noise.lfsr_reg >> 6) & 1) ^
-						((c->noise.lfsr_reg >> 5) & 1)) ?
-					VOL_INIT_MAX / MAX_CHAN_VOLUME :
-					VOL_INIT_MIN / MAX_CHAN_VOLUME;
-			}
+		if (!c->enabled)
+			continue;
 
-			sample += ((pos - prev_pos) / c->freq_inc) * c->val;
-			prev_pos = pos;
-		}
+		if ((seq_step & 1) == 0)
+			update_len(c);
 
-		if (c->muted)
-			continue;
+		if (i == 0 && (seq_step & 3) == 2 && c->enabled)
+			update_sweep(c);
 
-		sample += c->val;
-		sample *= c->volume;
-		sample /= 4;
+		if (i != 2 && seq_step == 7 && c->enabled)
+			update_env(c);
 
-		left[i] += sample * c->on_left * vol_l;
-		right[i] += sample * c->on_right * vol_r;
+		chan_output(c, time, false);
 	}
+
+	seq_step = (seq_step + 1) & 7;
 }
 
 static void chan_trigger(uint_fast8_t i)
@@ -366,6 +544,7 @@ static void chan_trigger(uint_fast8_t i)
 
 	chan_enable(i, 1);
 	c->volume = c->volume_init;
+	c->timer = 0;
 
 	// volume envelope
 	{
@@ -374,10 +553,8 @@ static void chan_trigger(uint_fast8_t i)
 
 		c->env.step = val & 0x07;
 		c->env.up   = val & 0x08 ? 1 : 0;
-		c->env.inc  = c->env.step ?
-			(FREQ_INC_REF * 64ul) / ((uint32_t)c->env.step * AUDIO_SAMPLE_RATE) :
-			(8ul * FREQ_INC_REF) / AUDIO_SAMPLE_RATE ;
-		c->env.counter = 0;
+		c->env.active = 1;
+		c->env.counter = c->env.step;
 	}
 
 	// freq sweep
@@ -388,9 +565,7 @@ static void chan_trigger(uint_fast8_t i)
 		c->sweep.rate  = (val >> 4) & 0x07;
 		c->sweep.up    = !(val & 0x08);
 		c->sweep.shift = (val & 0x07);
-		c->sweep.inc   = c->sweep.rate ?
-			((128 * FREQ_INC_REF) / (c->sweep.rate * AUDIO_SAMPLE_RATE)) : 0;
-		c->sweep.counter = FREQ_INC_REF;
+		c->sweep.counter = c->sweep.rate;
 	}
 
 	int len_max = 64;
@@ -403,8 +578,7 @@ static void chan_trigger(uint_fast8_t i)
 		c->val = VOL_INIT_MIN / MAX_CHAN_VOLUME;
 	}
 
-	c->len.inc = (256 * FREQ_INC_REF) / (AUDIO_SAMPLE_RATE * (len_max - c->len.load));
-	c->len.counter = 0;
+	c->len.counter = len_max - c->len.load;
 }
 
 /**
@@ -426,8 +600,36 @@ uint8_t audio_read(const uint16_t addr)
 		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
 	};
 
-	return audio_mem[addr - AUDIO_ADDR_COMPENSATION] |
-		ortab[addr - AUDIO_ADDR_COMPENSATION];
+	uint8_t val = audio_regs[addr - AUDIO_ADDR_COMPENSATION];
+
+	/* Channels are turned off as they are played. */
+	if(addr == 0xFF26)
+		val |= __atomic_load_n(&audio_status, __ATOMIC_ACQUIRE);
+
+	return val | ortab[addr - AUDIO_ADDR_COMPENSATION];
+}
+
+/**
+ * Write audio register as seen by the emulator.
+ * \return	false if the write is ignored, because the APU is powered off.
+ */
+static bool audio_write_regs(const uint16_t addr, const uint8_t val)
+{
+	if(addr == 0xFF26)
+	{
+		audio_regs[addr - AUDIO_ADDR_COMPENSATION] = val & 0x80;
+
+		if((val & 0x80) == 0)
+			memset(audio_regs, 0x00, 0xFF26 - AUDIO_ADDR_COMPENSATION);
+
+		return true;
+	}
+
+	if(audio_regs[0xFF26 - AUDIO_ADDR_COMPENSATION] == 0x00)
+		return false;
+
+	audio_regs[addr - AUDIO_ADDR_COMPENSATION] = val;
+	return true;
 }
 
 /**
@@ -435,8 +637,36 @@ uint8_t audio_read(const uint16_t addr)
  * \param addr	Address of audio register. Must be 0xFF10 <= addr <= 0xFF3F.
  *				This is not checked in this function.
  * \param val	Byte to write at address.
+ * \param cycle	Clock of the emulator at the write.
  */
-void audio_write(const uint16_t addr, const uint8_t val)
+void audio_write(const uint16_t addr, const uint8_t val, const uint32_t cycle)
+{
+	const uint32_t tail = audio_queue_tail;
+
+	if(!audio_write_regs(addr, val))
+		return;
+
+	/* The write is lost if the callback fell this far behind. */
+	if(tail - __atomic_load_n(&audio_queue_head, __ATOMIC_ACQUIRE) == AUDIO_QUEUE_SIZE)
+		return;
+
+	audio_queue[tail & (AUDIO_QUEUE_SIZE - 1)] = (struct audio_queue_entry){
+		.cycle = cycle,
+		.addr = addr - AUDIO_ADDR_COMPENSATION,
+		.val = val
+	};
+
+	/* The entry is written before the callback may see it. */
+	__atomic_store_n(&audio_queue_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Play a write to an audio register.
+ * \param addr	Address of audio register. Must be 0xFF10 <= addr <= 0xFF3F.
+ *				This is not checked in this function.
+ * \param val	Byte to write at address.
+ */
+static void audio_apply(const uint16_t addr, const uint8_t val)
 {
 	/* Find sound channel corresponding to register address. */
 	uint_fast8_t i;
@@ -455,6 +685,7 @@ void audio_write(const uint16_t addr, const uint8_t val)
 			chans[3].enabled = false;
 		}
 
+		__atomic_store_n(&audio_status, 0, __ATOMIC_RELEASE);
 		return;
 	}
 
@@ -475,7 +706,7 @@ void audio_write(const uint16_t addr, const uint8_t val)
 		// "zombie mode" stuff, needed for Prehistorik Man and probably
 		// others
 		if (chans[i].powered && chans[i].enabled) {
-			if ((chans[i].env.step == 0 && chans[i].env.inc != 0)) {
+			if ((chans[i].env.step == 0 && chans[i].env.active)) {
 				if (val & 0x08) {
 					chans[i].volume++;
 				} else {
@@ -554,12 +785,41 @@ void audio_write(const uint16_t addr, const uint8_t val)
 	}
 }
 
+static void audio_init_write(const uint16_t addr, const uint8_t val)
+{
+	audio_write_regs(addr, val);
+	audio_apply(addr, val);
+}
+
 void audio_init(void)
 {
 	/* Initialise channels and samples. */
 	memset(chans, 0, sizeof(chans));
 	chans[0].val = chans[1].val = -1;
 
+	blip_init();
+	memset(blip_buf, 0, sizeof(blip_buf));
+	memset(blip_sum, 0, sizeof(blip_sum));
+	seq_timer = 0;
+	seq_step = 0;
+
+	audio_queue_head = 0;
+	audio_queue_tail = 0;
+	audio_clock = 0;
+	audio_clock_rem = 0;
+
+#if AUDIO_RENDER_IN_FRAME
+	audio_ring_head = 0;
+	audio_ring_tail = 0;
+	audio_ring_playing = false;
+	audio_ring_frac = 0;
+	audio_ring_step = 1 << 16;
+	audio_ring_level = AUDIO_RING_LATENCY << AUDIO_LEVEL_SHIFT;
+	audio_underruns = 0;
+	audio_dropped = 0;
+	audio_skipped = 0;
+#endif
+
 	/* Initialise IO registers. */
 	{
 		static const uint8_t regs_init[] = { 0x80, 0xBF, 0xF3, 0xFF, 0x3F,
@@ -569,7 +829,7 @@ void audio_init(void)
 					      0x77, 0xF3, 0xF1 };
 
 		for(uint_fast8_t i = 0; i < sizeof(regs_init); ++i)
-			audio_write(0xFF10 + i, regs_init[i]);
+			audio_init_write(0xFF10 + i, regs_init[i]);
 	}
 
 	/* Initialise Wave Pattern RAM. */
@@ -580,10 +840,182 @@ void audio_init(void)
 					      0xac, 0xdd, 0xda, 0x48 };
 
 		for(uint_fast8_t i = 0; i < sizeof(wave_init); ++i)
-			audio_write(0xFF30 + i, wave_init[i]);
+			audio_init_write(0xFF30 + i, wave_init[i]);
 	}
 }
 
+/**
+ * Render len samples of every channel.
+ * \return	false if no channel is powered, and nothing was rendered.
+ */
+static bool audio_render(int16_t *left, int16_t *right, int len)
+{
+    bool playing = false;
+    
+    for(uint_fast8_t i = 0; i < 4; i++)
+    {
+        playing |= chans[i].powered || chans[i].amp[0] != 0 || chans[i].amp[1] != 0;
+    }
+    
+    while(len > 0)
+    {
+        int n = MIN(len, BLIP_SAMPLES);
+        const uint32_t end = (uint32_t)n << BLIP_FRAC_BITS;
+        
+        // Registers only change between renders
+        for(uint_fast8_t i = 0; i < 4; i++)
+        {
+            chan_update_period(i);
+            chan_output(&chans[i], 0, false);
+        }
+        
+        // Channels only change at the steps of the frame sequencer
+        while(seq_timer < end)
+        {
+            for(uint_fast8_t i = 0; i < 4; i++)
+            {
+                chan_run(&chans[i], seq_timer);
+            }
+            
+            seq_clock(seq_timer);
+            seq_timer += SEQ_PERIOD;
+        }
+        
+        for(uint_fast8_t i = 0; i < 4; i++)
+        {
+            struct chan *c = &chans[i];
+            
+            chan_run(c, end);
+            
+            // A stopped channel starts stepping again when triggered
+            c->timer = (c->powered && c->enabled) ? c->timer - end : 0;
+        }
+        
+        seq_timer -= end;
+        
+        blip_read(left, right, n);
+        
+        left += n;
+        right += n;
+        len -= n;
+    }
+    
+    return playing;
+}
+
+/**
+ * Render len samples from audio_clock, playing each queued write at its sample.
+ * Writes past the samples are left queued.
+ * \return	false if no channel is powered, and nothing was rendered.
+ */
+static bool audio_play(int16_t *left, int16_t *right, int len)
+{
+    bool playing = false;
+    int i = 0;
+    
+    // Play the samples up to each queued write, then the write
+    while(i < len)
+    {
+        uint32_t head = audio_queue_head;
+        
+        if(head == __atomic_load_n(&audio_queue_tail, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+        
+        const struct audio_queue_entry *entry = &audio_queue[head & (AUDIO_QUEUE_SIZE - 1)];
+        int32_t ahead = (int32_t)(entry->cycle - audio_clock);
+        
+#if !AUDIO_RENDER_IN_FRAME
+        if(ahead > (int32_t)AUDIO_LATENCY_MAX || ahead < -(int32_t)AUDIO_LATENCY)
+        {
+            // Play the write as if it was AUDIO_LATENCY ahead of sample i
+            audio_clock = entry->cycle - AUDIO_LATENCY - (uint32_t)(((uint64_t)i * DMG_CLOCK_FREQ_U) / AUDIO_SAMPLE_RATE);
+            audio_clock_rem = 0;
+            ahead = (int32_t)(entry->cycle - audio_clock);
+        }
+#endif
+        
+        int sample = (ahead > 0) ? (int)(((uint64_t)ahead * AUDIO_SAMPLE_RATE) / DMG_CLOCK_FREQ_U) : 0;
+        
+        if(sample >= len)
+        {
+            break;
+        }
+        
+        if(sample > i)
+        {
+            playing |= audio_render(left + i, right + i, sample - i);
+            i = sample;
+        }
+        
+        audio_apply(entry->addr + AUDIO_ADDR_COMPENSATION, entry->val);
+        __atomic_store_n(&audio_queue_head, head + 1, __ATOMIC_RELEASE);
+    }
+    
+    if(i < len)
+    {
+        playing |= audio_render(left + i, right + i, len - i);
+    }
+    
+    uint64_t cycles = (uint64_t)len * DMG_CLOCK_FREQ_U + audio_clock_rem;
+    audio_clock += cycles / AUDIO_SAMPLE_RATE;
+    audio_clock_rem = cycles % AUDIO_SAMPLE_RATE;
+    
+    return playing;
+}
+
+#if AUDIO_RENDER_IN_FRAME
+
+void audio_frame(const uint32_t cycle)
+{
+    int32_t ahead = (int32_t)(cycle - audio_clock);
+    
+    // The emulator was reset
+    if(ahead < 0 || ahead > (int32_t)AUDIO_LATENCY_MAX)
+    {
+        audio_clock = cycle;
+        audio_clock_rem = 0;
+        ahead = 0;
+    }
+    
+    // Samples before the clock of the emulator
+    int64_t span = (int64_t)ahead * AUDIO_SAMPLE_RATE - audio_clock_rem;
+    int len = (span > 0) ? (int)((span + DMG_CLOCK_FREQ_U - 1) / DMG_CLOCK_FREQ_U) : 0;
+    
+    static int16_t left[BLIP_SAMPLES];
+    static int16_t right[BLIP_SAMPLES];
+    
+    while(len > 0)
+    {
+        int n = MIN(len, BLIP_SAMPLES);
+        
+        memset(left, 0, n * sizeof(left[0]));
+        memset(right, 0, n * sizeof(right[0]));
+        
+        audio_play(left, right, n);
+        
+        uint32_t tail = audio_ring_tail;
+        uint32_t space = AUDIO_RING_SIZE - (tail - __atomic_load_n(&audio_ring_head, __ATOMIC_ACQUIRE));
+        
+        // Samples the callback has no room for are lost
+        if(n > (int)space)
+        {
+            audio_dropped += n - space;
+        }
+        
+        for(int i = 0; i < MIN(n, (int)space); i++)
+        {
+            audio_ring[0][(tail + i) & (AUDIO_RING_SIZE - 1)] = left[i];
+            audio_ring[1][(tail + i) & (AUDIO_RING_SIZE - 1)] = right[i];
+        }
+        
+        __atomic_store_n(&audio_ring_tail, tail + MIN(n, (int)space), __ATOMIC_RELEASE);
+        
+        len -= n;
+    }
+}
+
 /**
  * Playdate audio callback function.
  */
@@ -599,20 +1031,98 @@ int audio_callback(void *context, int16_t *left, int16_t *right, int len)
     if(gameScene->audioLocked){
         return 0;
     }
-
-    struct chan *c1 = chans;
-    struct chan *c2 = chans + 1;
-    struct chan *c3 = chans + 2;
-    struct chan *c4 = chans + 3;
     
-    if(!c1->powered && !c2->powered && !c3->powered && !c4->powered){
+    uint32_t head = audio_ring_head;
+    uint32_t available = __atomic_load_n(&audio_ring_tail, __ATOMIC_ACQUIRE) - head;
+    
+    // Wait for a few frames before playing, so that the buffer doesn't run out
+    // between two frames of the emulator
+    if(!audio_ring_playing && available < AUDIO_RING_LATENCY)
+    {
+        return 0;
+    }
+    
+    // Keep up with an emulator running ahead
+    if(available > AUDIO_RING_LATENCY_MAX)
+    {
+        audio_skipped += available - AUDIO_RING_LATENCY;
+        head += available - AUDIO_RING_LATENCY;
+        available = AUDIO_RING_LATENCY;
+    }
+    
+    // Read faster when more samples than AUDIO_RING_LATENCY are waiting, and
+    // slower when fewer are
+    audio_ring_level += ((int32_t)(available << AUDIO_LEVEL_SHIFT) - (int32_t)audio_ring_level) >> AUDIO_LEVEL_SHIFT;
+    
+    int32_t error = (int32_t)(audio_ring_level >> AUDIO_LEVEL_SHIFT) - (int32_t)AUDIO_RING_LATENCY;
+    error = MAX(-(int32_t)AUDIO_SAMPLES, MIN(error, (int32_t)AUDIO_SAMPLES));
+    audio_ring_step = (1 << 16) + error * AUDIO_RATE_ADJUST / (int32_t)AUDIO_SAMPLES;
+    
+    // Interpolate between the two samples around each position
+    uint32_t position = audio_ring_frac;
+    int n = 0;
+    
+    while(n < len)
+    {
+        uint32_t i = position >> 16;
+        
+        if(i + 1 >= available)
+        {
+            break;
+        }
+        
+        int32_t frac = (position & 0xFFFF) >> 1;
+        uint32_t a = (head + i) & (AUDIO_RING_SIZE - 1);
+        uint32_t b = (head + i + 1) & (AUDIO_RING_SIZE - 1);
+        
+        left[n] += audio_ring[0][a] + (((audio_ring[0][b] - audio_ring[0][a]) * frac) >> 15);
+        right[n] += audio_ring[1][a] + (((audio_ring[1][b] - audio_ring[1][a]) * frac) >> 15);
+        
+        position += audio_ring_step;
+        n++;
+    }
+    
+    // The buffer ran out, so the next samples wait for it to fill again
+    audio_ring_playing = (n == len);
+    
+    if(!audio_ring_playing)
+    {
+        audio_underruns++;
+    }
+    
+    audio_ring_frac = position & 0xFFFF;
+    __atomic_store_n(&audio_ring_head, head + (position >> 16), __ATOMIC_RELEASE);
+    
+    return n > 0;
+}
+
+void audio_get_stats(struct audio_stats *stats)
+{
+    stats->level = audio_ring_level >> AUDIO_LEVEL_SHIFT;
+    stats->ratio = audio_ring_step;
+    stats->underruns = audio_underruns;
+    stats->overruns = audio_dropped + audio_skipped;
+}
+
+#else
+
+/**
+ * Playdate audio callback function.
+ */
+int audio_callback(void *context, int16_t *left, int16_t *right, int len)
+{
+    PGB_GameScene **gameScene_ptr = context;
+    PGB_GameScene *gameScene = *gameScene_ptr;
+
+    if(!gameScene){
         return 0;
     }
     
-    update_square(left, right, 0, len);
-    update_square(left, right, 1, len);
-    update_wave(left, right, len);
-    update_noise(left, right, len);
+    if(gameScene->audioLocked){
+        return 0;
+    }
     
-    return 1;
+    return audio_play(left, right, len);
 }
+
+#endif
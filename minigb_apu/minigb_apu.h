@@ -17,21 +17,60 @@
 
 #define AUDIO_SAMPLES		((unsigned)(AUDIO_SAMPLE_RATE / VERTICAL_SYNC))
 
+/* Render audio from the emulator with audio_frame(), into a buffer that the
+ * audio callback only copies from. Otherwise audio is rendered by the callback,
+ * behind the emulator. */
+#ifndef AUDIO_RENDER_IN_FRAME
+#	define AUDIO_RENDER_IN_FRAME 1
+#endif
+
 /**
  * Read audio register at given address "addr".
  */
 uint8_t audio_read(const uint16_t addr);
 
 /**
- * Write "val" to audio register at given address "addr".
+ * Write "val" to audio register at given address "addr", at clock "cycle" of
+ * the emulator. The write is seen by audio_read() at once, and is played at its
+ * time. The channel status bits of NR52 change as the writes are played, so
+ * they lag behind the emulator by up to the play latency.
  */
-void audio_write(const uint16_t addr, const uint8_t val);
+void audio_write(const uint16_t addr, const uint8_t val, const uint32_t cycle);
 
 /**
  * Initialise audio driver.
  */
 void audio_init(void);
 
+#if AUDIO_RENDER_IN_FRAME
+/**
+ * Render the samples up to clock "cycle" of the emulator, playing the writes
+ * before it. Called after each frame.
+ */
+void audio_frame(const uint32_t cycle);
+
+/**
+ * State of the buffer between audio_frame() and the audio callback.
+ */
+struct audio_stats
+{
+	/* Samples waiting for the callback, averaged. */
+	uint32_t level;
+	/* Samples read from the buffer per sample played, in 1/65536. */
+	uint32_t ratio;
+	/* Times the callback ran out of samples. */
+	uint32_t underruns;
+	/* Samples dropped, or skipped to catch up with the emulator. */
+	uint32_t overruns;
+};
+
+/**
+ * Copy the state of the buffer to "stats". The counters are totals since
+ * audio_init().
+ */
+void audio_get_stats(struct audio_stats *stats);
+#endif
+
 /**
  * Playdate audio callback function.
  */
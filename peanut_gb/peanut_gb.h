@@ -35,13 +35,15 @@
 #include "version.all"	/* Version information */
 #include <stdlib.h>	/* Required for qsort */
 #include <stdint.h>	/* Required for int types */
-#include <string.h>	/* Required for memset */
+#include <string.h>	/* Required for memset and memcpy */
 #include <time.h>	/* Required for tm struct */
 
 /**
  * Sound support must be provided by an external library. When audio_read() and
  * audio_write() functions are provided, define ENABLE_SOUND to a non-zero value
  * before including peanut_gb.h in order for these functions to be used.
+ * audio_write() is also given the clock of the write, in cycles, so that it
+ * may be played at the right time.
  */
 #ifndef ENABLE_SOUND
 #	define ENABLE_SOUND 0
@@ -57,6 +59,36 @@
 	#define PEANUT_GB_HIGH_LCD_ACCURACY 0
 #endif
 
+/* Store the frame buffers with 2 bits per pixel, four pixels to a byte with
+ * the leftmost pixel in bits 7-6. Only the colour is kept, not the palette.
+ * Off by default, which stores a byte per pixel. */
+#ifndef PEANUT_GB_PACKED_FB
+	#define PEANUT_GB_PACKED_FB 0
+#endif
+
+/* Cache pre-decoded basic blocks of ROM, WRAM and HRAM code. The cache is
+ * allocated by the front-end and attached with gb_init_block_cache(). */
+#ifndef PEANUT_GB_BLOCK_CACHE
+	#define PEANUT_GB_BLOCK_CACHE 1
+#endif
+
+/* Only compute the flags of 8-bit additions, subtractions, increments and
+ * decrements when F is used. Off by default. */
+#ifndef PEANUT_GB_LAZY_FLAGS
+	#define PEANUT_GB_LAZY_FLAGS 0
+#endif
+
+/* Count executed instructions in gb->counter.instructions. */
+#ifndef PEANUT_GB_BENCHMARK
+	#define PEANUT_GB_BENCHMARK 0
+#endif
+
+/* Collect per-opcode counts, a sampled PC histogram and memory access counts
+ * in a profile attached with gb_init_profile(). Off by default. */
+#ifndef PEANUT_GB_PROFILE
+	#define PEANUT_GB_PROFILE 0
+#endif
+
 /* Interrupt masks */
 #define VBLANK_INTR	0x01
 #define LCDC_INTR	0x02
@@ -99,6 +131,10 @@
  * 4194304 / (8192 / 8) = 4096 clock cycles for sending 1 byte. */
 #define SERIAL_CYCLES		4096
 
+/* Upper bound of cycles between two updates of the counters, used when no
+ * event is due. Keeps pending_cycles small while the LCD and timer are off. */
+#define EVENT_MAX_CYCLES	1024
+
 /* Calculating VSYNC. */
 #define DMG_CLOCK_FREQ		4194304.0
 #define SCREEN_REFRESH_CYCLES	70224.0
@@ -143,6 +179,8 @@
 #define VRAM_BMAP_2         (0x9C00 - VRAM_ADDR)
 #define VRAM_TILES_3        (0x8000 - VRAM_ADDR + VRAM_BANK_SIZE)
 #define VRAM_TILES_4        (0x8800 - VRAM_ADDR + VRAM_BANK_SIZE)
+/* Number of tiles in 0x8000-0x97FF. */
+#define VRAM_TILE_COUNT     384
 
 /* Interrupt jump addresses */
 #define VBLANK_INTR_ADDR    0x0040
@@ -232,6 +270,18 @@ struct count_s
 	uint_fast16_t div_count;	/* Divider Register Counter */
 	uint_fast16_t tima_count;	/* Timer Counter */
 	uint_fast16_t serial_count;	/* Serial Counter */
+
+	/* Cycles executed since the counters above were last brought up to
+	 * date, and cycles until the next LCD, timer or serial event. */
+	uint_fast16_t pending_cycles;
+	uint_fast16_t next_event;
+
+	/* Cycles executed before pending_cycles, wrapping around. */
+	uint32_t clock;
+
+#if PEANUT_GB_BENCHMARK
+	uint32_t instructions;		/* Instructions executed */
+#endif
 };
 
 struct gb_registers_s
@@ -329,8 +379,111 @@ enum gb_serial_rx_ret_e
 	GB_SERIAL_RX_NO_CONNECTION = 1
 };
 
+#if PEANUT_GB_PACKED_FB
+static uint8_t gb_front_fb[LCD_HEIGHT][LCD_WIDTH / 4];
+static uint8_t gb_back_fb[LCD_HEIGHT][LCD_WIDTH / 4];
+#else
 static uint8_t gb_front_fb[LCD_HEIGHT][LCD_WIDTH];
 static uint8_t gb_back_fb[LCD_HEIGHT][LCD_WIDTH];
+#endif
+
+#if PEANUT_GB_BLOCK_CACHE
+/* Number of blocks in the cache. Must be a power of two. */
+#define GB_BLOCK_CACHE_SIZE	1024
+/* Maximum number of instructions in a block. */
+#define GB_BLOCK_MAX_OPS	16
+
+/**
+ * A pre-decoded instruction.
+ */
+struct gb_block_op_s
+{
+	const void *handler;	/* Opcode handler in __gb_run_cpu() */
+	uint16_t imm;		/* Immediate operand, if any */
+	uint8_t opcode;
+	uint8_t length;		/* Instruction length in bytes */
+};
+
+/**
+ * A straight-line run of instructions, ending at the first instruction that
+ * may change the flow of execution or the interrupt state.
+ */
+struct gb_block_s
+{
+	/* Page the block was decoded from, as found in read_map. Tells ROM
+	 * banks mapped at the same address apart. */
+	const uint8_t *page;
+	uint32_t generation;	/* Of the RAM page holding the code */
+	uint16_t pc;		/* Address of the first instruction */
+	uint16_t end;		/* Address of the last byte */
+	uint8_t count;		/* Number of instructions, 0 if unused */
+	struct gb_block_op_s ops[GB_BLOCK_MAX_OPS];
+};
+
+/**
+ * Direct-mapped cache of decoded blocks.
+ */
+struct gb_block_cache_s
+{
+	struct gb_block_s blocks[GB_BLOCK_CACHE_SIZE];
+
+	/* WRAM and HRAM bytes holding cached code, and the 256 byte WRAM
+	 * pages holding any. A write to a byte of code bumps the generation
+	 * of its page, or of HRAM, which invalidates the blocks decoded from
+	 * it. WRAM blocks do not cross pages. */
+	uint32_t wram_code_bytes[WRAM_SIZE / 32];
+	uint32_t hram_code[4];
+	uint32_t wram_code;
+	uint32_t wram_generation[WRAM_SIZE / 256];
+	uint32_t hram_generation;
+
+	/* Statistics. */
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t invalidations;
+};
+#endif
+
+#if PEANUT_GB_PROFILE
+/* Number of slots in the PC histogram. Must be a power of two. */
+#define GB_PROFILE_PC_SLOTS	4096
+/* Instructions executed between PC samples. A prime, so that sampling does
+ * not lock onto the length of a loop. */
+#define GB_PROFILE_PC_PERIOD	61
+
+/**
+ * A slot of the sampled PC histogram.
+ */
+struct gb_profile_sample_s
+{
+	uint16_t bank;		/* ROM bank, 0 outside of 0x4000-0x7FFF */
+	uint16_t pc;
+	uint32_t count;		/* Number of samples, 0 if unused */
+};
+
+/**
+ * Execution profile, filled in while the CPU runs.
+ */
+struct gb_profile_s
+{
+	/* Executions and cycles of each opcode. CB prefixed instructions are
+	 * also counted by their second byte in cb_count. */
+	uint64_t op_count[0x100];
+	uint64_t op_cycles[0x100];
+	uint64_t cb_count[0x100];
+	uint64_t halt_cycles;
+
+	/* Memory accesses through __gb_read() and __gb_write() per 4 KiB
+	 * page, including instruction fetches and block decoding. */
+	uint64_t reads[0x10];
+	uint64_t writes[0x10];
+
+	/* Sampled PC histogram, hashed by ROM bank and address. */
+	struct gb_profile_sample_s pc_samples[GB_PROFILE_PC_SLOTS];
+	uint32_t dropped_samples;	/* Samples lost to a full histogram */
+	uint32_t sample_countdown;
+};
+#endif
 
 /**
  * Emulator context.
@@ -374,6 +527,9 @@ struct gb_s
 	/* Cartridge information:
 	 * Memory Bank Controller (MBC) type. */
 	uint8_t mbc;
+	/* Handles writes to the MBC registers at 0x0000-0x7FFF. Chosen by
+	 * gb_init() for the MBC type. */
+	void (*mbc_write)(struct gb_s*, const uint_fast16_t addr, const uint8_t val);
 	/* Whether the MBC has internal RAM. */
 	uint8_t cart_ram;
 	/* Number of ROM banks in cartridge. */
@@ -401,6 +557,16 @@ struct gb_s
 	};
 
 	struct cpu_registers_s cpu_reg;
+#if PEANUT_GB_LAZY_FLAGS
+	/* Last ALU operation whose flags have not been written to F yet. */
+	struct
+	{
+		uint8_t op;
+		uint8_t x;
+		uint8_t y;
+		uint16_t result;
+	} lazy_flags;
+#endif
 	struct gb_registers_s gb_reg;
 	struct count_s counter;
 
@@ -410,6 +576,45 @@ struct gb_s
 	uint8_t hram[HRAM_SIZE];
 	uint8_t oam[OAM_SIZE];
 
+	/* Memory map of the 16 pages of 4 KiB in the address space. Pages
+	 * that can be accessed directly point to their backing memory; NULL
+	 * pages go through __gb_read_slow() and __gb_write_slow(). Rebuilt by
+	 * __gb_update_memory_map() when the MBC state changes. Only memory
+	 * allocated outside of this struct is mapped, so that the context
+	 * may be copied. */
+	uint8_t *read_map[0x10];
+	uint8_t *write_map[0x10];
+
+#if PEANUT_GB_BLOCK_CACHE
+	/* Decoded block cache, NULL if not attached. */
+	struct gb_block_cache_s *block_cache;
+#endif
+#if PEANUT_GB_PROFILE
+	/* Execution profile, NULL if not attached. */
+	struct gb_profile_s *profile;
+#endif
+
+	/* Idle loop detection. */
+	struct
+	{
+		/* Loop seen last, and the state at the end of its last
+		 * iteration. */
+		const uint8_t *page;
+		uint16_t pc;
+		uint16_t branch;
+		uint16_t cycles;	/* Cycles per iteration, 0 if not idle */
+		uint_fast16_t pending_cycles;
+		uint16_t af, bc, de, hl, sp;
+
+		/* Code of a loop outside of ROM, including the jump, as it
+		 * was when the loop was checked. */
+		uint8_t code[32];
+
+		/* Statistics. */
+		uint32_t loops;		/* Number of times a loop was skipped */
+		uint64_t skipped_cycles;
+	} idle;
+
 	struct
 	{
 		/**
@@ -438,12 +643,84 @@ struct gb_s
 
 		uint8_t window_clear;
 		uint8_t WY;
+
+		/* Sprites on each line, in the order they are drawn. Rebuilt
+		 * by __gb_bin_sprites() when sprites_dirty is set. */
+#if PEANUT_GB_HIGH_LCD_ACCURACY
+		uint8_t line_sprites[LCD_HEIGHT][MAX_SPRITES_LINE];
+#else
+		uint8_t line_sprites[LCD_HEIGHT][NUM_SPRITES];
+#endif
+		uint8_t line_sprite_count[LCD_HEIGHT];
+
+		/* Hash of what each line of the front (0) and back (1) frame
+		 * buffers was drawn from. See __gb_line_hash(). */
+		uint32_t line_hash[2][LCD_HEIGHT];
+
+		/* Changed on every write that changes VRAM, OAM, or a register
+		 * that lines are drawn from. frame_generation is its value at
+		 * the start of the current frame, and drawn_generation at the
+		 * end of the frame on screen. */
+		uint32_t generation;
+		uint32_t frame_generation;
+		uint32_t drawn_generation;
+
+		/* Tile data decoded to 2 bits per pixel, with the rightmost
+		 * pixel in bits 1-0. Row r of tile t is at t * 8 + r, which is
+		 * half its offset in VRAM. Tiles flagged in tile_dirty are
+		 * decoded again before a line is drawn. */
+		uint16_t tile_rows[VRAM_TILE_COUNT * 8];
+		uint32_t tile_dirty[VRAM_TILE_COUNT / 32];
+
+#if PEANUT_GB_PACKED_FB
+		/* Two packed pixels, leftmost in bits 3-2, mapped through the
+		 * background palette. Rebuilt when bg_lut_dirty is set. */
+		uint8_t bg_lut[16];
+
+		/* The 256x256 background of each tile map, packed, before the
+		 * palette is applied. Bit n of plane_valid[map][y] is set when
+		 * tile n of line y is drawn in the plane. Tile map and tile
+		 * data writes clear the bits of the tiles they change.
+		 * plane_select holds the tile data select the plane was drawn
+		 * with, or 0xFF when it is not drawn at all. plane_version of
+		 * a line changes whenever its tiles do, so that the line hash
+		 * need not read the tiles. */
+		uint8_t bg_plane[2][256][256 / 4];
+		uint32_t plane_valid[2][256];
+		uint32_t plane_version[2][256];
+		uint8_t plane_select[2];
+
+		/* Tiles used by each row of each tile map, and by the whole
+		 * map, with either tile data select. Bit n of
+		 * plane_tiles_dirty[map] is set when row n of the map changed,
+		 * and its tiles must be found again. */
+		uint32_t plane_tiles[2][32][VRAM_TILE_COUNT / 32];
+		uint32_t plane_tiles_all[2][VRAM_TILE_COUNT / 32];
+		uint32_t plane_tiles_dirty[2];
+#endif
         
-		/* Only support 30fps frame skip. */
-		uint8_t frame_skip_count : 1;
+		/* Frames skipped since the last one drawn. */
+		uint8_t frame_skip_count;
         
         /* Playdate custom implementation */
         uint8_t back_fb_enabled : 1;
+
+		/* OAM or the sprite size changed since the sprites were
+		 * binned. */
+		uint8_t sprites_dirty : 1;
+
+		/* Nothing changed since the frame on screen was drawn, so the
+		 * lines of this frame are not drawn. See __gb_draw_line(). */
+		uint8_t frame_unchanged : 1;
+
+		/* The frame on screen was drawn without changes midway, so it
+		 * is what drawn_generation draws. */
+		uint8_t drawn_valid : 1;
+
+#if PEANUT_GB_PACKED_FB
+		/* BGP changed since bg_lut was built. */
+		uint8_t bg_lut_dirty : 1;
+#endif
 	} display;
 
 	/**
@@ -455,11 +732,19 @@ struct gb_s
 	 */
 	struct
 	{
-		/* Set to enable interlacing. Interlacing will start immediately
-		 * (at the next line drawing).
+		/* Number of frames skipped after each one drawn, so 1 draws
+		 * at 30fps. Takes effect at the next frame.
 		 */
-		uint8_t frame_skip : 1;
+		uint8_t frame_skip;
         uint8_t sound : 1;
+		/* Set to skip ahead through loops that only poll memory and
+		 * IO registers while waiting for an event. */
+		uint8_t idle_skip : 1;
+
+		/* Bit per line, set when a line is drawn that may differ from
+		 * the same line of the other frame buffer. The front-end
+		 * clears the bits of the lines it has shown. */
+		uint32_t line_dirty[(LCD_HEIGHT + 31) / 32];
         
 		union
 		{
@@ -531,10 +816,167 @@ void gb_set_rtc(struct gb_s *gb, const struct tm * const time)
 	gb->cart_rtc[4] = time->tm_yday >> 8; /* High 1 bit of day counter. */
 }
 
+void __gb_sync_counters(struct gb_s *gb);
+void __gb_schedule_next_event(struct gb_s *gb);
+
 /**
- * Internal function used to read bytes.
+ * Internal function used to rebuild the memory map. Must be called whenever
+ * the selected ROM or RAM bank, cart RAM enable or mode select changes.
  */
-uint8_t __gb_read(struct gb_s *gb, const uint_fast16_t addr)
+void __gb_update_memory_map(struct gb_s *gb)
+{
+	uint_fast16_t rom_bank = gb->selected_rom_bank;
+	uint8_t *cram_read = NULL;
+	uint8_t *cram_write = NULL;
+
+	if(gb->mbc == 1 && gb->cart_mode_select)
+		rom_bank &= 0x1F;
+
+	/* RTC registers and disabled cart RAM are handled by the slow path. */
+	if(gb->cart_ram && gb->enable_cart_ram && gb->gb_cart_ram != NULL &&
+			!(gb->mbc == 3 && gb->cart_ram_bank >= 0x08))
+	{
+		if((gb->cart_mode_select || gb->mbc != 1) &&
+				gb->cart_ram_bank < gb->num_ram_banks)
+			cram_read = gb->gb_cart_ram + gb->cart_ram_bank * CRAM_BANK_SIZE;
+		else
+			cram_read = gb->gb_cart_ram;
+
+		if(gb->cart_mode_select &&
+				gb->cart_ram_bank < gb->num_ram_banks)
+			cram_write = gb->gb_cart_ram + gb->cart_ram_bank * CRAM_BANK_SIZE;
+		else if(gb->num_ram_banks)
+			cram_write = gb->gb_cart_ram;
+	}
+
+	for(uint_fast8_t i = 0; i < 4; i++)
+	{
+		gb->read_map[0x0 + i] = gb->gb_rom + i * 0x1000;
+		gb->read_map[0x4 + i] = gb->gb_rom + rom_bank * ROM_BANK_SIZE + i * 0x1000;
+		/* Writes to ROM control the MBC. */
+		gb->write_map[0x0 + i] = NULL;
+		gb->write_map[0x4 + i] = NULL;
+	}
+
+	for(uint_fast8_t i = 0; i < 2; i++)
+	{
+		gb->read_map[0x8 + i] = gb->vram + i * 0x1000;
+#if ENABLE_LCD
+		/* Writes to tile data must flag the decoded tile. */
+		gb->write_map[0x8 + i] = NULL;
+#else
+		gb->write_map[0x8 + i] = gb->vram + i * 0x1000;
+#endif
+		gb->read_map[0xA + i] = cram_read ? cram_read + i * 0x1000 : NULL;
+		gb->write_map[0xA + i] = cram_write ? cram_write + i * 0x1000 : NULL;
+		gb->read_map[0xC + i] = gb->write_map[0xC + i] = gb->wram + i * 0x1000;
+	}
+
+	/* Echo RAM. The last page also holds OAM, IO and HRAM. */
+	gb->read_map[0xE] = gb->write_map[0xE] = gb->wram;
+	gb->read_map[0xF] = gb->write_map[0xF] = NULL;
+
+#if PEANUT_GB_BLOCK_CACHE
+	if(gb->block_cache != NULL)
+	{
+		/* Writes to WRAM holding cached code must go through
+		 * __gb_write_slow() so that the code is invalidated. */
+		if(gb->block_cache->wram_code & 0x0000FFFF)
+			gb->write_map[0xC] = gb->write_map[0xE] = NULL;
+
+		if(gb->block_cache->wram_code & 0xFFFF0000)
+			gb->write_map[0xD] = NULL;
+	}
+
+	/* The code being executed may have been remapped, so stop executing
+	 * the current block. */
+	gb->counter.next_event = 0;
+#endif
+}
+
+#if PEANUT_GB_BLOCK_CACHE
+/**
+ * Internal function used to drop all decoded blocks.
+ */
+void __gb_flush_block_cache(struct gb_s *gb)
+{
+	struct gb_block_cache_s *cache = gb->block_cache;
+
+	for(uint_fast16_t i = 0; i < GB_BLOCK_CACHE_SIZE; i++)
+		cache->blocks[i].count = 0;
+
+	cache->wram_code = 0;
+	memset(cache->wram_code_bytes, 0, sizeof(cache->wram_code_bytes));
+	memset(cache->hram_code, 0, sizeof(cache->hram_code));
+}
+
+/**
+ * Internal function used to check whether the 4 KiB WRAM pages holding code,
+ * which writes must not bypass, differ between two sets of 256 byte pages.
+ */
+uint_fast8_t __gb_code_pages_changed(const uint32_t before,
+		const uint32_t after)
+{
+	return ((before & 0x0000FFFF) != 0) != ((after & 0x0000FFFF) != 0) ||
+		((before & 0xFFFF0000) != 0) != ((after & 0xFFFF0000) != 0);
+}
+
+/**
+ * Internal function used to invalidate the blocks decoded from WRAM or HRAM
+ * around addr, after it has been written to. addr must be within WRAM
+ * (0xC000-0xDFFF) or HRAM.
+ */
+void __gb_invalidate_code(struct gb_s *gb, const uint_fast16_t addr)
+{
+	struct gb_block_cache_s *cache = gb->block_cache;
+
+	if(cache == NULL)
+		return;
+
+	if(addr >= HRAM_ADDR)
+	{
+		const uint_fast8_t i = addr - HRAM_ADDR;
+
+		if((cache->hram_code[i >> 5] & ((uint32_t)1 << (i & 31))) == 0)
+			return;
+
+		/* The blocks of HRAM are decoded again, and mark their
+		 * bytes again. */
+		cache->hram_generation++;
+		memset(cache->hram_code, 0, sizeof(cache->hram_code));
+	}
+	else
+	{
+		const uint_fast16_t i = addr - WRAM_0_ADDR;
+		const uint_fast8_t page = i >> 8;
+		const uint32_t wram_code = cache->wram_code;
+
+		/* Data next to code is written without invalidating it. */
+		if((cache->wram_code_bytes[i >> 5] & ((uint32_t)1 << (i & 31))) == 0)
+			return;
+
+		cache->wram_generation[page]++;
+		memset(&cache->wram_code_bytes[page * 8], 0,
+				8 * sizeof(cache->wram_code_bytes[0]));
+		cache->wram_code &= ~((uint32_t)1 << page);
+
+		/* Let writes to a 4 KiB page without code go direct again. */
+		if(__gb_code_pages_changed(wram_code, cache->wram_code))
+			__gb_update_memory_map(gb);
+	}
+
+	cache->invalidations++;
+
+	/* Stop executing the current block, which may have been
+	 * modified. */
+	gb->counter.next_event = 0;
+}
+#endif
+
+/**
+ * Internal function used to read bytes that are not in the memory map.
+ */
+uint8_t __gb_read_slow(struct gb_s *gb, const uint_fast16_t addr)
 {
 	switch(addr >> 12)
 	{
@@ -640,9 +1082,13 @@ uint8_t __gb_read(struct gb_s *gb, const uint_fast16_t addr)
 
 		/* Timer Registers */
 		case 0x04:
+			__gb_sync_counters(gb);
+			__gb_schedule_next_event(gb);
 			return gb->gb_reg.DIV;
 
 		case 0x05:
+			__gb_sync_counters(gb);
+			__gb_schedule_next_event(gb);
 			return gb->gb_reg.TIMA;
 
 		case 0x06:
@@ -711,141 +1157,286 @@ uint8_t __gb_read(struct gb_s *gb, const uint_fast16_t addr)
 }
 
 /**
- * Internal function used to write bytes.
+ * Internal function used to read bytes.
  */
-void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
+uint8_t __gb_read(struct gb_s *gb, const uint_fast16_t addr)
 {
-	switch(addr >> 12)
+	const uint8_t *page = gb->read_map[addr >> 12];
+
+#if PEANUT_GB_PROFILE
+	if(gb->profile != NULL)
+		gb->profile->reads[addr >> 12]++;
+#endif
+
+	if(page != NULL)
+		return page[addr & 0x0FFF];
+
+	return __gb_read_slow(gb, addr);
+}
+
+/**
+ * Internal functions used to write to the registers of each type of MBC.
+ * The memory map is rebuilt by the caller afterwards.
+ */
+void __gb_mbc0_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
+{
+	if(addr >= 0x6000)
+		gb->cart_mode_select = (val & 1);
+}
+
+void __gb_mbc1_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
+{
+	switch(addr >> 13)
 	{
 	case 0x0:
-	case 0x1:
-		if(gb->mbc == 2 && addr & 0x10)
-			return;
-		else if(gb->mbc > 0 && gb->cart_ram)
+		if(gb->cart_ram)
 			gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
 
 		return;
 
-	case 0x2:
-		if(gb->mbc == 5)
-		{
-			gb->selected_rom_bank = (gb->selected_rom_bank & 0x100) | val;
-			gb->selected_rom_bank =
-				gb->selected_rom_bank & gb->num_rom_banks_mask;
-			return;
-		}
+	case 0x1:
+		gb->selected_rom_bank = (val & 0x1F) | (gb->selected_rom_bank & 0x60);
+
+		if((gb->selected_rom_bank & 0x1F) == 0x00)
+			gb->selected_rom_bank++;
+
+		gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
+		return;
 
-	/* Intentional fall through. */
+	case 0x2:
+		gb->cart_ram_bank = (val & 3);
+		gb->selected_rom_bank = ((val & 3) << 5) | (gb->selected_rom_bank & 0x1F);
+		gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
+		return;
 
 	case 0x3:
-		if(gb->mbc == 1)
-		{
-			//selected_rom_bank = val & 0x7;
-			gb->selected_rom_bank = (val & 0x1F) | (gb->selected_rom_bank & 0x60);
+		gb->cart_mode_select = (val & 1);
+		return;
+	}
+}
 
-			if((gb->selected_rom_bank & 0x1F) == 0x00)
-				gb->selected_rom_bank++;
-		}
-		else if(gb->mbc == 2 && addr & 0x10)
-		{
-			gb->selected_rom_bank = val & 0x0F;
+void __gb_mbc2_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
+{
+	switch(addr >> 13)
+	{
+	case 0x0:
+		if(!(addr & 0x10) && gb->cart_ram)
+			gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
 
-			if(!gb->selected_rom_bank)
-				gb->selected_rom_bank++;
-		}
-		else if(gb->mbc == 3)
+		return;
+
+	case 0x1:
+		if(addr & 0x10)
 		{
-			gb->selected_rom_bank = val & 0x7F;
+			gb->selected_rom_bank = val & 0x0F;
 
 			if(!gb->selected_rom_bank)
 				gb->selected_rom_bank++;
-		}
-		else if(gb->mbc == 5)
-			gb->selected_rom_bank = (val & 0x01) << 8 | (gb->selected_rom_bank & 0xFF);
-		gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
-		return;
 
-	case 0x4:
-	case 0x5:
-		if(gb->mbc == 1)
-		{
-			gb->cart_ram_bank = (val & 3);
-			gb->selected_rom_bank = ((val & 3) << 5) | (gb->selected_rom_bank & 0x1F);
 			gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
 		}
-		else if(gb->mbc == 3)
-			gb->cart_ram_bank = val;
-		else if(gb->mbc == 5)
-			gb->cart_ram_bank = (val & 0x0F);
 
 		return;
 
-	case 0x6:
-	case 0x7:
+	case 0x3:
 		gb->cart_mode_select = (val & 1);
 		return;
+	}
+}
+
+void __gb_mbc3_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
+{
+	switch(addr >> 13)
+	{
+	case 0x0:
+		if(gb->cart_ram)
+			gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
 
-	case 0x8:
-	case 0x9:
-		gb->vram[addr - VRAM_ADDR] = val;
 		return;
 
-	case 0xA:
-	case 0xB:
-		if(gb->cart_ram && gb->enable_cart_ram)
-		{
-			if(gb->mbc == 3 && gb->cart_ram_bank >= 0x08)
-				gb->cart_rtc[gb->cart_ram_bank - 0x08] = val;
-			else if(gb->cart_mode_select &&
-					gb->cart_ram_bank < gb->num_ram_banks)
-			{
-				gb->gb_cart_ram[addr - CART_RAM_ADDR + (gb->cart_ram_bank * CRAM_BANK_SIZE)] = val;
-			}
-			else if(gb->num_ram_banks)
-				gb->gb_cart_ram[addr - CART_RAM_ADDR] = val;
-		}
+	case 0x1:
+		gb->selected_rom_bank = val & 0x7F;
 
-		return;
+		if(!gb->selected_rom_bank)
+			gb->selected_rom_bank++;
 
-	case 0xC:
-		gb->wram[addr - WRAM_0_ADDR] = val;
+		gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
 		return;
 
-	case 0xD:
-		gb->wram[addr - WRAM_1_ADDR + WRAM_BANK_SIZE] = val;
+	case 0x2:
+		gb->cart_ram_bank = val;
 		return;
 
-	case 0xE:
-		gb->wram[addr - ECHO_ADDR] = val;
+	case 0x3:
+		gb->cart_mode_select = (val & 1);
 		return;
+	}
+}
 
-	case 0xF:
-		if(addr < OAM_ADDR)
-		{
-			gb->wram[addr - ECHO_ADDR] = val;
-			return;
-		}
+void __gb_mbc5_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
+{
+	switch(addr >> 12)
+	{
+	case 0x0:
+	case 0x1:
+		if(gb->cart_ram)
+			gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
 
-		if(addr < UNUSED_ADDR)
-		{
-			gb->oam[addr - OAM_ADDR] = val;
-			return;
-		}
+		return;
 
-		/* Unusable memory area. */
-		if(addr < IO_ADDR)
-			return;
+	case 0x2:
+		gb->selected_rom_bank = (gb->selected_rom_bank & 0x100) | val;
+		gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
+		return;
 
-		if(HRAM_ADDR <= addr && addr < INTR_EN_ADDR)
-		{
-			gb->hram[addr - IO_ADDR] = val;
-			return;
+	case 0x3:
+		gb->selected_rom_bank = (val & 0x01) << 8 | (gb->selected_rom_bank & 0xFF);
+		gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
+		return;
+
+	case 0x4:
+	case 0x5:
+		gb->cart_ram_bank = (val & 0x0F);
+		return;
+
+	case 0x6:
+	case 0x7:
+		gb->cart_mode_select = (val & 1);
+		return;
+	}
+}
+
+/**
+ * Internal function used to write bytes that are not in the memory map.
+ */
+void __gb_write_slow(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
+{
+	switch(addr >> 12)
+	{
+	case 0x0:
+	case 0x1:
+	case 0x2:
+	case 0x3:
+	case 0x4:
+	case 0x5:
+	case 0x6:
+	case 0x7:
+		gb->mbc_write(gb, addr, val);
+		__gb_update_memory_map(gb);
+		return;
+
+	case 0x8:
+	case 0x9:
+#if ENABLE_LCD
+		if(gb->vram[addr - VRAM_ADDR] == val)
+			return;
+
+		gb->display.generation++;
+#endif
+		gb->vram[addr - VRAM_ADDR] = val;
+#if ENABLE_LCD
+		if(addr < VRAM_ADDR + VRAM_BMAP_1)
+			gb->display.tile_dirty[(addr - VRAM_ADDR) >> 9] |=
+				(uint32_t)1 << (((addr - VRAM_ADDR) >> 4) & 31);
+#if PEANUT_GB_PACKED_FB
+		else
+		{
+			/* Clear the tile from the 8 plane lines it is on. */
+			const uint_fast8_t map = (addr >> 10) & 1;
+			const uint_fast8_t y = ((addr >> 5) & 0x1F) * 8;
+			const uint32_t mask = ~((uint32_t)1 << (addr & 0x1F));
+
+			for(uint_fast8_t r = 0; r < 8; r++)
+			{
+				gb->display.plane_valid[map][y + r] &= mask;
+				gb->display.plane_version[map][y + r]++;
+			}
+
+			gb->display.plane_tiles_dirty[map] |= (uint32_t)1 << (y >> 3);
+		}
+#endif
+#endif
+		return;
+
+	case 0xA:
+	case 0xB:
+		if(gb->cart_ram && gb->enable_cart_ram)
+		{
+			if(gb->mbc == 3 && gb->cart_ram_bank >= 0x08)
+				gb->cart_rtc[gb->cart_ram_bank - 0x08] = val;
+			else if(gb->cart_mode_select &&
+					gb->cart_ram_bank < gb->num_ram_banks)
+			{
+				gb->gb_cart_ram[addr - CART_RAM_ADDR + (gb->cart_ram_bank * CRAM_BANK_SIZE)] = val;
+			}
+			else if(gb->num_ram_banks)
+				gb->gb_cart_ram[addr - CART_RAM_ADDR] = val;
+		}
+
+		return;
+
+	case 0xC:
+		gb->wram[addr - WRAM_0_ADDR] = val;
+#if PEANUT_GB_BLOCK_CACHE
+		__gb_invalidate_code(gb, addr);
+#endif
+		return;
+
+	case 0xD:
+		gb->wram[addr - WRAM_1_ADDR + WRAM_BANK_SIZE] = val;
+#if PEANUT_GB_BLOCK_CACHE
+		__gb_invalidate_code(gb, addr);
+#endif
+		return;
+
+	case 0xE:
+		gb->wram[addr - ECHO_ADDR] = val;
+#if PEANUT_GB_BLOCK_CACHE
+		__gb_invalidate_code(gb, addr - ECHO_ADDR + WRAM_0_ADDR);
+#endif
+		return;
+
+	case 0xF:
+		if(addr < OAM_ADDR)
+		{
+			gb->wram[addr - ECHO_ADDR] = val;
+#if PEANUT_GB_BLOCK_CACHE
+			__gb_invalidate_code(gb, addr - ECHO_ADDR + WRAM_0_ADDR);
+#endif
+			return;
+		}
+
+		if(addr < UNUSED_ADDR)
+		{
+#if ENABLE_LCD
+			if(gb->oam[addr - OAM_ADDR] == val)
+				return;
+
+			gb->display.sprites_dirty = 1;
+			gb->display.generation++;
+#endif
+			gb->oam[addr - OAM_ADDR] = val;
+			return;
+		}
+
+		/* Unusable memory area. */
+		if(addr < IO_ADDR)
+			return;
+
+		if(HRAM_ADDR <= addr && addr < INTR_EN_ADDR)
+		{
+			gb->hram[addr - IO_ADDR] = val;
+#if PEANUT_GB_BLOCK_CACHE
+			__gb_invalidate_code(gb, addr);
+#endif
+			return;
 		}
 
 		if((addr >= 0xFF10) && (addr <= 0xFF3F))
 		{
             if(gb->direct.sound){
-                audio_write(addr, val);
+                audio_write(addr, val,
+                        gb->counter.clock + gb->counter.pending_cycles);
             }
             else {
                 gb->hram[addr - IO_ADDR] = val;
@@ -878,16 +1469,22 @@ void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
 			return;
 
 		case 0x02:
+			__gb_sync_counters(gb);
 			gb->gb_reg.SC = val;
+			__gb_schedule_next_event(gb);
 			return;
 
 		/* Timer Registers */
 		case 0x04:
+			__gb_sync_counters(gb);
 			gb->gb_reg.DIV = 0x00;
+			__gb_schedule_next_event(gb);
 			return;
 
 		case 0x05:
+			__gb_sync_counters(gb);
 			gb->gb_reg.TIMA = val;
+			__gb_schedule_next_event(gb);
 			return;
 
 		case 0x06:
@@ -895,23 +1492,43 @@ void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
 			return;
 
 		case 0x07:
+			__gb_sync_counters(gb);
 			gb->gb_reg.TAC = val;
+			__gb_schedule_next_event(gb);
 			return;
 
 		/* Interrupt Flag Register */
 		case 0x0F:
 			gb->gb_reg.IF = (val | 0b11100000);
+#if PEANUT_GB_BLOCK_CACHE
+			/* Check for interrupts before the next instruction. */
+			gb->counter.next_event = 0;
+#endif
 			return;
 
 		/* LCD Registers */
 		case 0x40:
+			__gb_sync_counters(gb);
+
 			if(((gb->gb_reg.LCDC & LCDC_ENABLE) == 0) &&
 				(val & LCDC_ENABLE))
 			{
 				gb->counter.lcd_count = 0;
 				gb->lcd_blank = 1;
+#if ENABLE_LCD
+				/* The first frame starts without passing line 0. */
+				gb->display.frame_unchanged = 0;
+#endif
 			}
 
+#if ENABLE_LCD
+			if((gb->gb_reg.LCDC ^ val) & LCDC_OBJ_SIZE)
+				gb->display.sprites_dirty = 1;
+
+			if(gb->gb_reg.LCDC != val)
+				gb->display.generation++;
+#endif
+
 			gb->gb_reg.LCDC = val;
 
 			/* LY fixed to 0 when LCD turned off. */
@@ -922,14 +1539,16 @@ void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
 				if(gb->lcd_mode != LCD_VBLANK)
 				{
 					gb->gb_reg.LCDC |= LCDC_ENABLE;
-					return;
 				}
-
-				gb->gb_reg.STAT = (gb->gb_reg.STAT & ~0x03) | LCD_VBLANK;
-				gb->gb_reg.LY = 0;
-				gb->counter.lcd_count = 0;
+				else
+				{
+					gb->gb_reg.STAT = (gb->gb_reg.STAT & ~0x03) | LCD_VBLANK;
+					gb->gb_reg.LY = 0;
+					gb->counter.lcd_count = 0;
+				}
 			}
 
+			__gb_schedule_next_event(gb);
 			return;
 
 		case 0x41:
@@ -937,10 +1556,18 @@ void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
 			return;
 
 		case 0x42:
+#if ENABLE_LCD
+			if(gb->gb_reg.SCY != val)
+				gb->display.generation++;
+#endif
 			gb->gb_reg.SCY = val;
 			return;
 
 		case 0x43:
+#if ENABLE_LCD
+			if(gb->gb_reg.SCX != val)
+				gb->display.generation++;
+#endif
 			gb->gb_reg.SCX = val;
 			return;
 
@@ -951,23 +1578,63 @@ void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
 
 		/* DMA Register */
 		case 0x46:
+		{
+			const uint8_t *page;
+
 			gb->gb_reg.DMA = (val % 0xF1);
+			page = gb->read_map[gb->gb_reg.DMA >> 4];
+
+			/* The source never crosses a page, so copy it at once
+			 * when it is mapped. */
+			if(page != NULL)
+			{
+				page += (gb->gb_reg.DMA & 0x0F) << 8;
+
+#if ENABLE_LCD
+				/* Most games copy OAM every frame, often
+				 * unchanged. */
+				if(memcmp(gb->oam, page, OAM_SIZE) == 0)
+					return;
+
+				gb->display.sprites_dirty = 1;
+				gb->display.generation++;
+#endif
+				memcpy(gb->oam, page, OAM_SIZE);
+				return;
+			}
+
+#if ENABLE_LCD
+			gb->display.sprites_dirty = 1;
+			gb->display.generation++;
+#endif
 
 			for(uint8_t i = 0; i < OAM_SIZE; i++)
 				gb->oam[i] = __gb_read(gb, (gb->gb_reg.DMA << 8) + i);
 
 			return;
+		}
 
 		/* DMG Palette Registers */
 		case 0x47:
+#if ENABLE_LCD
+			if(gb->gb_reg.BGP != val)
+				gb->display.generation++;
+#endif
 			gb->gb_reg.BGP = val;
 			gb->display.bg_palette[0] = (gb->gb_reg.BGP & 0x03);
 			gb->display.bg_palette[1] = (gb->gb_reg.BGP >> 2) & 0x03;
 			gb->display.bg_palette[2] = (gb->gb_reg.BGP >> 4) & 0x03;
 			gb->display.bg_palette[3] = (gb->gb_reg.BGP >> 6) & 0x03;
+#if PEANUT_GB_PACKED_FB
+			gb->display.bg_lut_dirty = 1;
+#endif
 			return;
 
 		case 0x48:
+#if ENABLE_LCD
+			if(gb->gb_reg.OBP0 != val)
+				gb->display.generation++;
+#endif
 			gb->gb_reg.OBP0 = val;
 			gb->display.sp_palette[0] = (gb->gb_reg.OBP0 & 0x03);
 			gb->display.sp_palette[1] = (gb->gb_reg.OBP0 >> 2) & 0x03;
@@ -976,6 +1643,10 @@ void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
 			return;
 
 		case 0x49:
+#if ENABLE_LCD
+			if(gb->gb_reg.OBP1 != val)
+				gb->display.generation++;
+#endif
 			gb->gb_reg.OBP1 = val;
 			gb->display.sp_palette[4] = (gb->gb_reg.OBP1 & 0x03);
 			gb->display.sp_palette[5] = (gb->gb_reg.OBP1 >> 2) & 0x03;
@@ -985,10 +1656,18 @@ void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
 
 		/* Window Position Registers */
 		case 0x4A:
+#if ENABLE_LCD
+			if(gb->gb_reg.WY != val)
+				gb->display.generation++;
+#endif
 			gb->gb_reg.WY = val;
 			return;
 
 		case 0x4B:
+#if ENABLE_LCD
+			if(gb->gb_reg.WX != val)
+				gb->display.generation++;
+#endif
 			gb->gb_reg.WX = val;
 			return;
 
@@ -1000,6 +1679,10 @@ void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
 		/* Interrupt Enable Register */
 		case 0xFF:
 			gb->gb_reg.IE = val;
+#if PEANUT_GB_BLOCK_CACHE
+			/* Check for interrupts before the next instruction. */
+			gb->counter.next_event = 0;
+#endif
 			return;
 		}
 	}
@@ -1007,10 +1690,178 @@ void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
 	(gb->gb_error)(gb, GB_INVALID_WRITE, addr);
 }
 
-uint8_t __gb_execute_cb(struct gb_s *gb)
+/**
+ * Internal function used to write bytes.
+ */
+void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
+{
+	uint8_t *page = gb->write_map[addr >> 12];
+
+#if PEANUT_GB_PROFILE
+	if(gb->profile != NULL)
+		gb->profile->writes[addr >> 12]++;
+#endif
+
+	if(page != NULL)
+	{
+		page[addr & 0x0FFF] = val;
+		return;
+	}
+
+	__gb_write_slow(gb, addr, val);
+}
+
+#if PEANUT_GB_LAZY_FLAGS
+#define GB_LAZY_NONE	0
+#define GB_LAZY_ADD	1
+#define GB_LAZY_SUB	2
+#define GB_LAZY_INC	3
+#define GB_LAZY_DEC	4
+
+/**
+ * Internal function used to get the carry flag while the flags of the last
+ * ALU operation have not been written to F.
+ */
+uint8_t __gb_lazy_carry(const struct gb_s *gb)
+{
+	switch(gb->lazy_flags.op)
+	{
+	case GB_LAZY_ADD:
+	case GB_LAZY_SUB:
+		return (gb->lazy_flags.result & 0xFF00) ? 1 : 0;
+
+	case GB_LAZY_INC:
+	case GB_LAZY_DEC:
+		/* Carry was kept from the operation before. */
+		return gb->lazy_flags.x;
+
+	default:
+		return gb->cpu_reg.f_bits.c;
+	}
+}
+
+/**
+ * Internal function used to write the flags of the last ALU operation to F.
+ */
+void __gb_compute_flags(struct gb_s *gb)
+{
+	const uint16_t result = gb->lazy_flags.result;
+	uint8_t z = ((result & 0xFF) == 0x00);
+	uint8_t n;
+	uint8_t h;
+	uint8_t c;
+
+	switch(gb->lazy_flags.op)
+	{
+	case GB_LAZY_ADD:
+	case GB_LAZY_SUB:
+		n = (gb->lazy_flags.op == GB_LAZY_SUB);
+		h = (gb->lazy_flags.x ^ gb->lazy_flags.y ^ result) & 0x10 ? 1 : 0;
+		c = (result & 0xFF00) ? 1 : 0;
+		break;
+
+	case GB_LAZY_INC:
+		n = 0;
+		h = ((result & 0x0F) == 0x00);
+		c = gb->lazy_flags.x;
+		break;
+
+	case GB_LAZY_DEC:
+		n = 1;
+		h = ((result & 0x0F) == 0x0F);
+		c = gb->lazy_flags.x;
+		break;
+
+	default:
+		return;
+	}
+
+	gb->cpu_reg.f = (gb->cpu_reg.f & 0x0F) |
+		(z << 7) | (n << 6) | (h << 5) | (c << 4);
+	gb->lazy_flags.op = GB_LAZY_NONE;
+}
+
+/* Carry flag, for ADC and SBC. */
+#define __GB_CARRY(gb)	__gb_lazy_carry(gb)
+
+/* Must be used before F is read or partly written. */
+#define __GB_FLAGS(gb)							\
+	do {								\
+		if((gb)->lazy_flags.op != GB_LAZY_NONE)			\
+			__gb_compute_flags(gb);				\
+	} while(0)
+
+/* Flags of x + y (+ carry) and x - y (- carry), with a 16-bit result. */
+#define __GB_ADD_FLAGS(gb, x_, y_, result_)				\
+	do {								\
+		(gb)->lazy_flags.op = GB_LAZY_ADD;			\
+		(gb)->lazy_flags.x = (x_);				\
+		(gb)->lazy_flags.y = (y_);				\
+		(gb)->lazy_flags.result = (result_);			\
+	} while(0)
+
+#define __GB_SUB_FLAGS(gb, x_, y_, result_)				\
+	do {								\
+		(gb)->lazy_flags.op = GB_LAZY_SUB;			\
+		(gb)->lazy_flags.x = (x_);				\
+		(gb)->lazy_flags.y = (y_);				\
+		(gb)->lazy_flags.result = (result_);			\
+	} while(0)
+
+/* Flags of 8-bit increments and decrements, which keep the carry flag. */
+#define __GB_INC_FLAGS(gb, result_)					\
+	do {								\
+		(gb)->lazy_flags.x = __gb_lazy_carry(gb);		\
+		(gb)->lazy_flags.op = GB_LAZY_INC;			\
+		(gb)->lazy_flags.result = (result_);			\
+	} while(0)
+
+#define __GB_DEC_FLAGS(gb, result_)					\
+	do {								\
+		(gb)->lazy_flags.x = __gb_lazy_carry(gb);		\
+		(gb)->lazy_flags.op = GB_LAZY_DEC;			\
+		(gb)->lazy_flags.result = (result_);			\
+	} while(0)
+#else
+#define __GB_CARRY(gb)	((gb)->cpu_reg.f_bits.c)
+#define __GB_FLAGS(gb)	do {} while(0)
+
+#define __GB_ADD_FLAGS(gb, x_, y_, result_)				\
+	do {								\
+		(gb)->cpu_reg.f_bits.z = (((result_) & 0xFF) == 0x00);	\
+		(gb)->cpu_reg.f_bits.n = 0;				\
+		(gb)->cpu_reg.f_bits.h =				\
+			((x_) ^ (y_) ^ (result_)) & 0x10 ? 1 : 0;	\
+		(gb)->cpu_reg.f_bits.c = ((result_) & 0xFF00) ? 1 : 0;	\
+	} while(0)
+
+#define __GB_SUB_FLAGS(gb, x_, y_, result_)				\
+	do {								\
+		(gb)->cpu_reg.f_bits.z = (((result_) & 0xFF) == 0x00);	\
+		(gb)->cpu_reg.f_bits.n = 1;				\
+		(gb)->cpu_reg.f_bits.h =				\
+			((x_) ^ (y_) ^ (result_)) & 0x10 ? 1 : 0;	\
+		(gb)->cpu_reg.f_bits.c = ((result_) & 0xFF00) ? 1 : 0;	\
+	} while(0)
+
+#define __GB_INC_FLAGS(gb, result_)					\
+	do {								\
+		(gb)->cpu_reg.f_bits.z = ((result_) == 0x00);		\
+		(gb)->cpu_reg.f_bits.n = 0;				\
+		(gb)->cpu_reg.f_bits.h = (((result_) & 0x0F) == 0x00);	\
+	} while(0)
+
+#define __GB_DEC_FLAGS(gb, result_)					\
+	do {								\
+		(gb)->cpu_reg.f_bits.z = ((result_) == 0x00);		\
+		(gb)->cpu_reg.f_bits.n = 1;				\
+		(gb)->cpu_reg.f_bits.h = (((result_) & 0x0F) == 0x0F);	\
+	} while(0)
+#endif
+
+uint8_t __gb_execute_cb(struct gb_s *gb, uint8_t cbop)
 {
 	uint8_t inst_cycles;
-	uint8_t cbop = __gb_read(gb, gb->cpu_reg.pc++);
 	uint8_t r = (cbop & 0x7);
 	uint8_t b = (cbop >> 3) & 0x7;
 	uint8_t d = (cbop >> 3) & 0x1;
@@ -1203,62 +2054,509 @@ uint8_t __gb_execute_cb(struct gb_s *gb)
 }
 
 #if ENABLE_LCD
-struct sprite_data {
-	uint8_t sprite_number;
-	uint8_t x;
-};
+/**
+ * Internal function used to sort the sprites in OAM into the lines they are
+ * on, in the order they are drawn. Called when OAM or the sprite size has
+ * changed.
+ */
+void __gb_bin_sprites(struct gb_s *gb)
+{
+	const uint_fast8_t height = gb->gb_reg.LCDC & LCDC_OBJ_SIZE ? 16 : 8;
+
+	gb->display.sprites_dirty = 0;
+	memset(gb->display.line_sprite_count, 0,
+			sizeof(gb->display.line_sprite_count));
 
 #if PEANUT_GB_HIGH_LCD_ACCURACY
-static int compare_sprites(const void *in1, const void *in2)
-{
-	const struct sprite_data *sd1 = in1, *sd2 = in2;
-	int x_res = (int)sd1->x - (int)sd2->x;
-	if(x_res != 0)
-		return x_res;
+	/* The first ten sprites in OAM on each line are drawn, the one with the
+	 * lowest X coordinate on top, then the one first in OAM. */
+	for(uint_fast8_t s = 0; s < NUM_SPRITES; s++)
+#else
+	/* Every sprite on each line is drawn, the one first in OAM on top. */
+	for(uint_fast8_t s = NUM_SPRITES - 1; s != (uint_fast8_t)-1; s--)
+#endif
+	{
+		const int_fast16_t top = gb->oam[4 * s] - 16;
+		int_fast16_t y = top < 0 ? 0 : top;
+		const int_fast16_t end = top + height > LCD_HEIGHT ?
+			LCD_HEIGHT : top + height;
 
-	return (int)sd1->sprite_number - (int)sd2->sprite_number;
-}
+		for(; y < end; y++)
+		{
+			uint8_t *count = &gb->display.line_sprite_count[y];
+			uint8_t *sprites = gb->display.line_sprites[y];
+#if PEANUT_GB_HIGH_LCD_ACCURACY
+			uint_fast8_t i = *count;
+
+			if(i == MAX_SPRITES_LINE)
+				continue;
+
+			/* Insert behind the sprites with a lower X, which come
+			 * later in the drawing order. */
+			while(i > 0 && gb->oam[4 * sprites[i - 1] + 1] <=
+					gb->oam[4 * s + 1])
+			{
+				sprites[i] = sprites[i - 1];
+				i--;
+			}
+
+			sprites[i] = s;
+			(*count)++;
+#else
+			sprites[(*count)++] = s;
 #endif
+		}
+	}
+}
 
-void __gb_draw_line(struct gb_s *gb)
+#if PEANUT_GB_PACKED_FB
+/**
+ * Internal function used to clear the tiles of both planes that use a tile
+ * flagged in tile_dirty, with either tile data select.
+ */
+void __gb_invalidate_planes(struct gb_s *gb)
 {
-    uint8_t *pixels = gb->display.back_fb_enabled ? gb_back_fb[gb->gb_reg.LY] : gb_front_fb[gb->gb_reg.LY];
-    
-    /* If background is enabled, draw it. */
-	if(gb->gb_reg.LCDC & LCDC_BG_ENABLE)
+	for(uint_fast8_t map = 0; map < 2; map++)
 	{
-		/* Calculate current background line to draw. Constant because
-		 * this function draws only this one line each time it is
-		 * called. */
-		const uint8_t bg_y = gb->gb_reg.LY + gb->gb_reg.SCY;
+		uint32_t used = 0;
 
-		/* Get selected background map address for first tile
-		 * corresponding to current line.
-		 * 0x20 (32) is the width of a background tile, and the bit
-		 * shift is to calculate the address. */
-		const uint16_t bg_map =
-			((gb->gb_reg.LCDC & LCDC_BG_MAP) ?
-			 VRAM_BMAP_2 : VRAM_BMAP_1)
-			+ (bg_y >> 3) * 0x20;
+		if(gb->display.plane_tiles_dirty[map])
+		{
+			memset(gb->display.plane_tiles_all[map], 0, sizeof(gb->display.plane_tiles_all[map]));
 
-		/* The displays (what the player sees) X coordinate, drawn right
-		 * to left. */
-		uint8_t disp_x = LCD_WIDTH - 1;
+			for(uint_fast8_t row = 0; row < 32; row++)
+			{
+				const uint8_t *entries = gb->vram + VRAM_BMAP_1 + map * 0x400 + row * 0x20;
+				uint32_t *tiles = gb->display.plane_tiles[map][row];
 
-		/* The X coordinate to begin drawing the background at. */
-		uint8_t bg_x = disp_x + gb->gb_reg.SCX;
+				if(gb->display.plane_tiles_dirty[map] & ((uint32_t)1 << row))
+				{
+					memset(tiles, 0, sizeof(gb->display.plane_tiles[map][row]));
 
-		/* Get tile index for current background tile. */
-		uint8_t idx = gb->vram[bg_map + (bg_x >> 3)];
-		/* Y coordinate of tile pixel to draw. */
-		const uint8_t py = (bg_y & 0x07);
-		/* X coordinate of tile pixel to draw. */
-		uint8_t px = 7 - (bg_x & 0x07);
+					for(uint_fast8_t e = 0; e < 0x20; e++)
+					{
+						/* With the second select, tile 0 is at 0x8800. */
+						const uint_fast16_t tile_1 = entries[e];
+						const uint_fast16_t tile_2 = 128 + (entries[e] ^ 0x80);
 
-		uint16_t tile;
+						tiles[tile_1 >> 5] |= (uint32_t)1 << (tile_1 & 31);
+						tiles[tile_2 >> 5] |= (uint32_t)1 << (tile_2 & 31);
+					}
+				}
 
-		/* Select addressing mode. */
-		if(gb->gb_reg.LCDC & LCDC_TILE_SELECT)
+				for(uint_fast8_t i = 0; i < VRAM_TILE_COUNT / 32; i++)
+					gb->display.plane_tiles_all[map][i] |= tiles[i];
+			}
+
+			gb->display.plane_tiles_dirty[map] = 0;
+		}
+
+		for(uint_fast8_t i = 0; i < VRAM_TILE_COUNT / 32; i++)
+			used |= gb->display.plane_tiles_all[map][i] & gb->display.tile_dirty[i];
+
+		if(!used)
+			continue;
+
+		for(uint_fast8_t row = 0; row < 32; row++)
+		{
+			const uint8_t *entries = gb->vram + VRAM_BMAP_1 + map * 0x400 + row * 0x20;
+
+			used = 0;
+
+			for(uint_fast8_t i = 0; i < VRAM_TILE_COUNT / 32; i++)
+				used |= gb->display.plane_tiles[map][row][i] & gb->display.tile_dirty[i];
+
+			if(!used)
+				continue;
+
+			for(uint_fast8_t e = 0; e < 0x20; e++)
+			{
+				const uint_fast16_t tile_1 = entries[e];
+				const uint_fast16_t tile_2 = 128 + (entries[e] ^ 0x80);
+
+				if(!(gb->display.tile_dirty[tile_1 >> 5] & ((uint32_t)1 << (tile_1 & 31))) &&
+					!(gb->display.tile_dirty[tile_2 >> 5] & ((uint32_t)1 << (tile_2 & 31))))
+					continue;
+
+				for(uint_fast8_t r = 0; r < 8; r++)
+				{
+					gb->display.plane_valid[map][row * 8 + r] &= ~((uint32_t)1 << e);
+					gb->display.plane_version[map][row * 8 + r]++;
+				}
+			}
+		}
+	}
+}
+#endif
+
+/**
+ * Internal function used to decode the tiles written to since the last call.
+ */
+void __gb_decode_tiles(struct gb_s *gb)
+{
+#if PEANUT_GB_PACKED_FB
+	uint32_t changed = 0;
+
+	for(uint_fast8_t i = 0; i < VRAM_TILE_COUNT / 32; i++)
+		changed |= gb->display.tile_dirty[i];
+
+	if(changed)
+		__gb_invalidate_planes(gb);
+#endif
+
+	for(uint_fast8_t i = 0; i < VRAM_TILE_COUNT / 32; i++)
+	{
+		uint32_t dirty = gb->display.tile_dirty[i];
+
+		gb->display.tile_dirty[i] = 0;
+
+		for(uint_fast16_t row = i * 32 * 8; dirty != 0; dirty >>= 1, row += 8)
+		{
+			if(!(dirty & 1))
+				continue;
+
+			for(uint_fast16_t r = row; r < row + 8; r++)
+			{
+				/* Interleave the bits of the two bytes. */
+				uint_fast16_t t1 = gb->vram[2 * r];
+				uint_fast16_t t2 = gb->vram[2 * r + 1];
+
+				t1 = (t1 | (t1 << 4)) & 0x0F0F;
+				t1 = (t1 | (t1 << 2)) & 0x3333;
+				t1 = (t1 | (t1 << 1)) & 0x5555;
+				t2 = (t2 | (t2 << 4)) & 0x0F0F;
+				t2 = (t2 | (t2 << 2)) & 0x3333;
+				t2 = (t2 | (t2 << 1)) & 0x5555;
+				gb->display.tile_rows[r] = t1 | (t2 << 1);
+			}
+		}
+	}
+}
+
+#define __GB_HASH(hash, val) ((hash) = ((hash) ^ (val)) * 0x01000193)
+
+/**
+ * Internal function used to hash everything that the current line is drawn
+ * from: registers, the tile rows of the background and window, and the
+ * sprites on the line. The tiles must be decoded, which also updates the
+ * plane versions.
+ */
+uint32_t __gb_line_hash(struct gb_s *gb, const uint8_t window)
+{
+	uint32_t hash = 0x811C9DC5;
+
+	__GB_HASH(hash, gb->gb_reg.LCDC);
+	__GB_HASH(hash, gb->gb_reg.BGP | gb->gb_reg.OBP0 << 8 |
+			gb->gb_reg.OBP1 << 16);
+
+#if PEANUT_GB_PACKED_FB
+	/* The plane lines stand for their tiles. */
+	if(gb->gb_reg.LCDC & LCDC_BG_ENABLE)
+	{
+		const uint8_t bg_y = gb->gb_reg.LY + gb->gb_reg.SCY;
+
+		__GB_HASH(hash, gb->gb_reg.SCX | bg_y << 8);
+		__GB_HASH(hash, gb->display.plane_version
+				[(gb->gb_reg.LCDC & LCDC_BG_MAP) ? 1 : 0][bg_y]);
+	}
+
+	if(window)
+	{
+		__GB_HASH(hash, gb->gb_reg.WX | gb->display.window_clear << 8);
+		__GB_HASH(hash, gb->display.plane_version
+				[(gb->gb_reg.LCDC & LCDC_WINDOW_MAP) ? 1 : 0]
+				[gb->display.window_clear]);
+	}
+#else
+	if(gb->gb_reg.LCDC & LCDC_BG_ENABLE)
+	{
+		const uint8_t bg_y = gb->gb_reg.LY + gb->gb_reg.SCY;
+		const uint16_t bg_map =
+			((gb->gb_reg.LCDC & LCDC_BG_MAP) ?
+			 VRAM_BMAP_2 : VRAM_BMAP_1)
+			+ (bg_y >> 3) * 0x20;
+
+		__GB_HASH(hash, gb->gb_reg.SCX & 0x07);
+
+		/* The line spans 21 tiles, or 20 when aligned. */
+		for(uint_fast8_t i = 0; i < 21; i++)
+		{
+			const uint8_t idx =
+				gb->vram[bg_map + (((gb->gb_reg.SCX >> 3) + i) & 0x1F)];
+			uint16_t tile;
+
+			if(gb->gb_reg.LCDC & LCDC_TILE_SELECT)
+				tile = VRAM_TILES_1 + idx * 0x10;
+			else
+				tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
+
+			__GB_HASH(hash, gb->display.tile_rows[(tile >> 1) + (bg_y & 0x07)]);
+		}
+	}
+
+	if(window)
+	{
+		uint16_t win_line = (gb->gb_reg.LCDC & LCDC_WINDOW_MAP) ?
+				    VRAM_BMAP_2 : VRAM_BMAP_1;
+		const uint8_t last_x = LCD_WIDTH - 1 - gb->gb_reg.WX + 7;
+
+		win_line += (gb->display.window_clear >> 3) * 0x20;
+		__GB_HASH(hash, gb->gb_reg.WX);
+
+		for(uint_fast8_t i = 0; i <= (last_x >> 3); i++)
+		{
+			const uint8_t idx = gb->vram[win_line + i];
+			uint16_t tile;
+
+			if(gb->gb_reg.LCDC & LCDC_TILE_SELECT)
+				tile = VRAM_TILES_1 + idx * 0x10;
+			else
+				tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
+
+			__GB_HASH(hash, gb->display.tile_rows[(tile >> 1) +
+					(gb->display.window_clear & 0x07)]);
+		}
+	}
+
+#endif
+
+	if(gb->gb_reg.LCDC & LCDC_OBJ_ENABLE)
+	{
+		for(uint_fast8_t i = 0;
+				i < gb->display.line_sprite_count[gb->gb_reg.LY]; i++)
+		{
+			const uint8_t s_4 = gb->display.line_sprites[gb->gb_reg.LY][i] * 4;
+			const uint8_t OY = gb->oam[s_4];
+			const uint8_t OT = gb->oam[s_4 + 2] &
+				(gb->gb_reg.LCDC & LCDC_OBJ_SIZE ? 0xFE : 0xFF);
+			const uint8_t OF = gb->oam[s_4 + 3];
+			uint8_t py = gb->gb_reg.LY - OY + 16;
+
+			if(OF & OBJ_FLIP_Y)
+				py = (gb->gb_reg.LCDC & LCDC_OBJ_SIZE ? 15 : 7) - py;
+
+			__GB_HASH(hash, s_4 | gb->oam[s_4 + 1] << 8 | OF << 16);
+			__GB_HASH(hash, gb->display.tile_rows[OT * 8 + py]);
+		}
+	}
+
+	return hash;
+}
+
+#if PEANUT_GB_PACKED_FB
+/**
+ * Internal function used to copy a line of a tile map plane into a packed
+ * line through the background palette, from pixel x to the end of the
+ * line. Tiles of the plane line that are not drawn yet are drawn first,
+ * from the decoded tile rows.
+ *
+ * \param map	Tile map, 0 for 0x9800 and 1 for 0x9C00.
+ * \param y	Line of the plane.
+ * \param sx	Pixel of the plane line copied to pixel x.
+ */
+void __gb_draw_plane(struct gb_s *gb, uint8_t *packed, const uint_fast8_t x,
+		const uint_fast8_t map, const uint_fast8_t y, const uint_fast8_t sx)
+{
+	const uint8_t select = gb->gb_reg.LCDC & LCDC_TILE_SELECT;
+	const uint8_t *entries = gb->vram + VRAM_BMAP_1 + map * 0x400 + (y >> 3) * 0x20;
+	uint8_t *row = gb->display.bg_plane[map][y];
+	uint32_t *valid = &gb->display.plane_valid[map][y];
+	/* Tiles the copy reads from, the last one may be read partly. */
+	const uint_fast8_t tiles = ((sx & 7) + LCD_WIDTH - x + 7) >> 3;
+
+	if(gb->display.plane_select[map] != select)
+	{
+		memset(gb->display.plane_valid[map], 0, sizeof(gb->display.plane_valid[map]));
+		gb->display.plane_select[map] = select;
+	}
+
+	for(uint_fast8_t i = 0, t = sx >> 3; i < tiles; i++, t = (t + 1) & 0x1F)
+	{
+		uint_fast16_t tile_row;
+		uint16_t tile;
+
+		if(*valid & ((uint32_t)1 << t))
+			continue;
+
+		if(select)
+			tile = VRAM_TILES_1 + entries[t] * 0x10;
+		else
+			tile = VRAM_TILES_2 + ((entries[t] + 0x80) % 0x100) * 0x10;
+
+		tile_row = gb->display.tile_rows[(tile >> 1) + (y & 0x07)];
+		row[t * 2] = tile_row >> 8;
+		row[t * 2 + 1] = tile_row & 0xFF;
+		*valid |= (uint32_t)1 << t;
+	}
+
+	/* The identity palette, 3-2-1-0. */
+	if(((x | sx) & 3) == 0 && gb->gb_reg.BGP == 0xE4)
+	{
+		/* Whole bytes, the plane line wraps around at most once. */
+		const uint_fast8_t n = (LCD_WIDTH - x) >> 2;
+		const uint_fast8_t first = MIN(n, 64 - (sx >> 2));
+
+		memcpy(packed + (x >> 2), row + (sx >> 2), first);
+		memcpy(packed + (x >> 2) + first, row, n - first);
+	}
+	else
+	{
+		/* Pixels not written yet, the leftmost in the highest bits.
+		 * Start with the pixels already in the first byte, left of x,
+		 * then the first plane byte without the pixels left of sx. */
+		const uint8_t *lut = gb->display.bg_lut;
+		uint_fast32_t pending = packed[x >> 2] >> (8 - 2 * (x & 3));
+		uint_fast8_t bits = 2 * (x & 3) + 8 - 2 * (sx & 3);
+		uint_fast8_t j = sx >> 2;
+
+		pending = (pending << (8 - 2 * (sx & 3))) |
+			((lut[row[j] >> 4] << 4 | lut[row[j] & 0x0F]) &
+			 (0xFF >> (2 * (sx & 3))));
+
+		for(uint_fast8_t i = x >> 2; i < LCD_WIDTH / 4;)
+		{
+			if(bits >= 8)
+			{
+				bits -= 8;
+				packed[i++] = pending >> bits;
+			}
+			else
+			{
+				j = (j + 1) & 0x3F;
+				pending = (pending << 8) | lut[row[j] >> 4] << 4 |
+					lut[row[j] & 0x0F];
+				bits += 8;
+			}
+		}
+	}
+}
+#endif
+
+
+void __gb_draw_line(struct gb_s *gb)
+{
+    const uint8_t target = gb->display.back_fb_enabled;
+    uint8_t *line = target ? gb_back_fb[gb->gb_reg.LY] : gb_front_fb[gb->gb_reg.LY];
+    const uint8_t *other_line = target ? gb_front_fb[gb->gb_reg.LY] : gb_back_fb[gb->gb_reg.LY];
+    const uint8_t window = (gb->gb_reg.LCDC & LCDC_WINDOW_ENABLE)
+			&& gb->gb_reg.LY >= gb->display.WY
+			&& gb->gb_reg.WX <= 166;
+    uint32_t hash;
+    
+    /* Nothing changed since the frame on screen was drawn, so this line
+     * is the same as the one on screen, and the buffers are not swapped
+     * at the end of the frame. */
+    if(gb->display.frame_unchanged)
+    {
+        if(gb->display.generation == gb->display.drawn_generation)
+        {
+            if(window)
+                gb->display.window_clear++;
+            
+            return;
+        }
+        
+        /* Something changed midway, so the lines skipped so far are taken
+         * from the frame on screen. */
+        for(uint_fast8_t y = 0; y < gb->gb_reg.LY; y++)
+        {
+            memcpy(target ? gb_back_fb[y] : gb_front_fb[y],
+                   target ? gb_front_fb[y] : gb_back_fb[y],
+                   sizeof(gb_front_fb[0]));
+            gb->display.line_hash[target][y] = gb->display.line_hash[!target][y];
+        }
+        
+        gb->display.frame_unchanged = 0;
+    }
+    
+    __gb_decode_tiles(gb);
+    
+    if(gb->display.sprites_dirty)
+        __gb_bin_sprites(gb);
+    
+    hash = __gb_line_hash(gb, window);
+    
+    /* The background covers the whole line, so a line drawn from the same
+     * inputs is the same, and need not be drawn again. */
+    if(gb->gb_reg.LCDC & LCDC_BG_ENABLE)
+    {
+        const uint8_t same_as_other = (hash == gb->display.line_hash[!target][gb->gb_reg.LY]);
+        
+        if(hash == gb->display.line_hash[target][gb->gb_reg.LY] || same_as_other)
+        {
+            if(hash != gb->display.line_hash[target][gb->gb_reg.LY])
+            {
+                memcpy(line, other_line, sizeof(gb_front_fb[0]));
+                gb->display.line_hash[target][gb->gb_reg.LY] = hash;
+            }
+            
+            if(!same_as_other)
+                gb->direct.line_dirty[gb->gb_reg.LY >> 5] |= (uint32_t)1 << (gb->gb_reg.LY & 31);
+            
+            if(window)
+                gb->display.window_clear++;
+            
+            return;
+        }
+    }
+    
+    gb->display.line_hash[target][gb->gb_reg.LY] = hash;
+    gb->direct.line_dirty[gb->gb_reg.LY >> 5] |= (uint32_t)1 << (gb->gb_reg.LY & 31);
+    
+#if PEANUT_GB_PACKED_FB
+    if(gb->display.bg_lut_dirty)
+    {
+        for(uint_fast8_t i = 0; i < 16; i++)
+        {
+            gb->display.bg_lut[i] = gb->display.bg_palette[i >> 2] << 2 |
+                gb->display.bg_palette[i & 0x3];
+        }
+        
+        gb->display.bg_lut_dirty = 0;
+    }
+#else
+    uint8_t *pixels = line;
+#endif
+    
+    /* If background is enabled, draw it. */
+	if(gb->gb_reg.LCDC & LCDC_BG_ENABLE)
+	{
+		/* Calculate current background line to draw. Constant because
+		 * this function draws only this one line each time it is
+		 * called. */
+		const uint8_t bg_y = gb->gb_reg.LY + gb->gb_reg.SCY;
+
+#if PEANUT_GB_PACKED_FB
+		__gb_draw_plane(gb, line, 0, (gb->gb_reg.LCDC & LCDC_BG_MAP) ? 1 : 0,
+				bg_y, gb->gb_reg.SCX);
+#else
+		/* Get selected background map address for first tile
+		 * corresponding to current line.
+		 * 0x20 (32) is the width of a background tile, and the bit
+		 * shift is to calculate the address. */
+		const uint16_t bg_map =
+			((gb->gb_reg.LCDC & LCDC_BG_MAP) ?
+			 VRAM_BMAP_2 : VRAM_BMAP_1)
+			+ (bg_y >> 3) * 0x20;
+
+		/* The displays (what the player sees) X coordinate, drawn right
+		 * to left. */
+		uint8_t disp_x = LCD_WIDTH - 1;
+
+		/* The X coordinate to begin drawing the background at. */
+		uint8_t bg_x = disp_x + gb->gb_reg.SCX;
+
+		/* Get tile index for current background tile. */
+		uint8_t idx = gb->vram[bg_map + (bg_x >> 3)];
+		/* Y coordinate of tile pixel to draw. */
+		const uint8_t py = (bg_y & 0x07);
+		/* X coordinate of tile pixel to draw. */
+		uint8_t px = 7 - (bg_x & 0x07);
+
+		uint16_t tile;
+
+		/* Select addressing mode. */
+		if(gb->gb_reg.LCDC & LCDC_TILE_SELECT)
 			tile = VRAM_TILES_1 + idx * 0x10;
 		else
 			tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
@@ -1266,8 +2564,7 @@ void __gb_draw_line(struct gb_s *gb)
 		tile += 2 * py;
 
 		/* fetch first tile */
-		uint8_t t1 = gb->vram[tile] >> px;
-		uint8_t t2 = gb->vram[tile + 1] >> px;
+		uint_fast16_t row = gb->display.tile_rows[tile >> 1] >> (2 * px);
 
 		for(; disp_x != 0xFF; disp_x--)
 		{
@@ -1284,25 +2581,32 @@ void __gb_draw_line(struct gb_s *gb)
 					tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
 
 				tile += 2 * py;
-				t1 = gb->vram[tile];
-				t2 = gb->vram[tile + 1];
+				row = gb->display.tile_rows[tile >> 1];
 			}
 
 			/* copy background */
-			uint8_t c = (t1 & 0x1) | ((t2 & 0x1) << 1);
+			uint8_t c = row & 0x3;
             pixels[disp_x] = (gb->display.bg_palette[c] | LCD_PALETTE_BG);
             
-			t1 >>= 1;
-			t2 >>= 1;
+			row >>= 2;
 			px++;
 		}
+#endif
 	}
     
 	/* draw window */
-	if(gb->gb_reg.LCDC & LCDC_WINDOW_ENABLE
-			&& gb->gb_reg.LY >= gb->display.WY
-			&& gb->gb_reg.WX <= 166)
+	if(window)
 	{
+#if PEANUT_GB_PACKED_FB
+		const uint_fast8_t win_map = (gb->gb_reg.LCDC & LCDC_WINDOW_MAP) ? 1 : 0;
+
+		if(gb->gb_reg.WX < 7)
+			__gb_draw_plane(gb, line, 0, win_map,
+					gb->display.window_clear, 7 - gb->gb_reg.WX);
+		else
+			__gb_draw_plane(gb, line, gb->gb_reg.WX - 7, win_map,
+					gb->display.window_clear, 0);
+#else
 		/* Calculate Window Map Address. */
 		uint16_t win_line = (gb->gb_reg.LCDC & LCDC_WINDOW_MAP) ?
 				    VRAM_BMAP_2 : VRAM_BMAP_1;
@@ -1326,8 +2630,7 @@ void __gb_draw_line(struct gb_s *gb)
 		tile += 2 * py;
 
 		// fetch first tile
-		uint8_t t1 = gb->vram[tile] >> px;
-		uint8_t t2 = gb->vram[tile + 1] >> px;
+		uint_fast16_t row = gb->display.tile_rows[tile >> 1] >> (2 * px);
 
 		// loop & copy window
 		uint8_t end = (gb->gb_reg.WX < 7 ? 0 : gb->gb_reg.WX - 7) - 1;
@@ -1347,18 +2650,17 @@ void __gb_draw_line(struct gb_s *gb)
 					tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
                 
 				tile += 2 * py;
-				t1 = gb->vram[tile];
-				t2 = gb->vram[tile + 1];
+				row = gb->display.tile_rows[tile >> 1];
 			}
 
 			// copy window
-			uint8_t c = (t1 & 0x1) | ((t2 & 0x1) << 1);
+			uint8_t c = row & 0x3;
             pixels[disp_x] = (gb->display.bg_palette[c] | LCD_PALETTE_BG);
             
-			t1 >>= 1;
-			t2 >>= 1;
+			row >>= 2;
 			px++;
 		}
+#endif
 
 		gb->display.window_clear++; // advance window line
 	}
@@ -1366,57 +2668,11 @@ void __gb_draw_line(struct gb_s *gb)
 	// draw sprites
 	if(gb->gb_reg.LCDC & LCDC_OBJ_ENABLE)
 	{
-#if PEANUT_GB_HIGH_LCD_ACCURACY
-		uint8_t number_of_sprites = 0;
-		struct sprite_data sprites_to_render[NUM_SPRITES];
-
-		/* Record number of sprites on the line being rendered, limited
-		 * to the maximum number sprites that the Game Boy is able to
-		 * render on each line (10 sprites). */
-		for(uint8_t sprite_number = 0;
-				sprite_number < PEANUT_GB_ARRAYSIZE(sprites_to_render);
-				sprite_number++)
-		{
-			/* Sprite Y position. */
-			uint8_t OY = gb->oam[4 * sprite_number + 0];
-			/* Sprite X position. */
-			uint8_t OX = gb->oam[4 * sprite_number + 1];
-
-			/* If sprite isn't on this line, continue. */
-			if (gb->gb_reg.LY +
-				(gb->gb_reg.LCDC & LCDC_OBJ_SIZE ? 0 : 8) >= OY
-					|| gb->gb_reg.LY + 16 < OY)
-				continue;
-
-
-			sprites_to_render[number_of_sprites].sprite_number = sprite_number;
-			sprites_to_render[number_of_sprites].x = OX;
-			number_of_sprites++;
-		}
-
-		/* If maximum number of sprites reached, prioritise X
-		 * coordinate and object location in OAM. */
-		qsort(&sprites_to_render[0], number_of_sprites,
-				sizeof(sprites_to_render[0]), compare_sprites);
-		if(number_of_sprites > MAX_SPRITES_LINE)
-			number_of_sprites = MAX_SPRITES_LINE;
-#endif
-
-		/* Render each sprite, from low priority to high priority. */
-#if PEANUT_GB_HIGH_LCD_ACCURACY
-		/* Render the top ten prioritised sprites on this scanline. */
-		for(uint8_t sprite_number = number_of_sprites - 1;
-				sprite_number != 0xFF;
-				sprite_number--)
-		{
-			uint8_t s = sprites_to_render[sprite_number].sprite_number;
-#else
-		for (uint8_t sprite_number = NUM_SPRITES - 1;
-			sprite_number != 0xFF;
-			sprite_number--)
+		/* Render each sprite on the line, from low priority to high
+		 * priority. */
+		for(uint8_t i = 0; i < gb->display.line_sprite_count[gb->gb_reg.LY]; i++)
 		{
-#endif
-            uint8_t s_4 = sprite_number * 4;
+            uint8_t s_4 = gb->display.line_sprites[gb->gb_reg.LY][i] * 4;
             
 			/* Sprite Y position. */
 			uint8_t OY = gb->oam[s_4];
@@ -1427,14 +2683,6 @@ void __gb_draw_line(struct gb_s *gb)
             /* Additional attributes. */
             uint8_t OF = gb->oam[s_4 + 3];
             
-#if !PEANUT_GB_HIGH_LCD_ACCURACY
-			/* If sprite isn't on this line, continue. */
-			if(gb->gb_reg.LY +
-					(gb->gb_reg.LCDC & LCDC_OBJ_SIZE ? 0 : 8) >= OY ||
-					gb->gb_reg.LY + 16 < OY)
-				continue;
-#endif
-            
 			/* Continue if sprite not visible. */
             if(OX == 0 || OX >= 168)
                 continue;
@@ -1448,8 +2696,7 @@ void __gb_draw_line(struct gb_s *gb)
             uint16_t t1_i = VRAM_TILES_1 + OT * 0x10 + 2 * py;
             
 			// fetch the tile
-			uint8_t t1 = gb->vram[t1_i];
-			uint8_t t2 = gb->vram[t1_i + 1];
+			uint_fast16_t row = gb->display.tile_rows[t1_i >> 1];
 
 			// handle x flip
 			uint8_t dir, start, end, shift;
@@ -1470,23 +2717,31 @@ void __gb_draw_line(struct gb_s *gb)
 			}
 
 			// copy tile
-			t1 >>= shift;
-			t2 >>= shift;
+			row >>= 2 * shift;
             
             uint8_t c_add = (OF & OBJ_PALETTE) ? 4 : 0;
             
 			for(uint8_t disp_x = start; disp_x != end; disp_x += dir)
 			{
-				uint8_t c = (t1 & 0x1) | ((t2 & 0x1) << 1);
+				uint8_t c = row & 0x3;
 				// check transparency / sprite overlap / background overlap
 
+#if PEANUT_GB_PACKED_FB
+				const uint8_t p_shift = 6 - 2 * (disp_x & 3);
+                
+				if(c && !((OF & OBJ_PRIORITY) && (line[disp_x >> 2] >> p_shift) & 0x3)){
+					/* Set pixel colour. */
+                    line[disp_x >> 2] = (line[disp_x >> 2] & ~(0x3 << p_shift)) |
+                        (gb->display.sp_palette[c + c_add] & 0x3) << p_shift;
+				}
+#else
 				if(c && !((OF & OBJ_PRIORITY) && pixels[disp_x] & 0x3)){
 					/* Set pixel colour. */
                     pixels[disp_x] = ((gb->display.sp_palette[c + c_add] | (OF & OBJ_PALETTE)) & ~LCD_PALETTE_BG);
 				}
+#endif
 
-                t1 >>= 1;
-                t2 >>= 1;
+                row >>= 2;
 			}
 		}
 	}
@@ -1494,83 +2749,659 @@ void __gb_draw_line(struct gb_s *gb)
 #endif
 
 /**
- * Internal function used to step the CPU.
+ * Internal function used to bring the DIV, serial, TIMA and LCD state up to
+ * date with the cycles executed since it was last called. Events that became
+ * due in that time (interrupts, new scanlines, drawing a line) are serviced
+ * here.
  */
-void __gb_step_cpu(struct gb_s *gb)
+void __gb_sync_counters(struct gb_s *gb)
 {
-	static const uint8_t op_cycles[0x100] =
+	const uint_fast16_t cycles = gb->counter.pending_cycles;
+
+	gb->counter.pending_cycles = 0;
+	gb->counter.clock += cycles;
+
+	/* DIV register timing */
+	gb->counter.div_count += cycles;
+	gb->gb_reg.DIV += gb->counter.div_count / DIV_CYCLES;
+	gb->counter.div_count %= DIV_CYCLES;
+
+	/* Check serial transmission. */
+	if(gb->gb_reg.SC & SERIAL_SC_TX_START)
 	{
-		/* *INDENT-OFF* */
-		/*0 1 2  3  4  5  6  7  8  9  A  B  C  D  E  F	*/
-		4,12, 8, 8, 4, 4, 8, 4,20, 8, 8, 8, 4, 4, 8, 4,	/* 0x00 */
-		4,12, 8, 8, 4, 4, 8, 4,12, 8, 8, 8, 4, 4, 8, 4,	/* 0x10 */
-		8,12, 8, 8, 4, 4, 8, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x20 */
-		8,12, 8, 8,12,12,12, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x30 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x40 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x50 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x60 */
-		8, 8, 8, 8, 8, 8, 4, 8, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x70 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x80 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x90 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xA0 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xB0 */
-		8,12,12,16,12,16, 8,16, 8,16,12, 8,12,24, 8,16,	/* 0xC0 */
-		8,12,12, 0,12,16, 8,16, 8,16,12, 0,12, 0, 8,16,	/* 0xD0 */
-		12,12,8, 0, 0,16, 8,16,16, 4,16, 0, 0, 0, 8,16,	/* 0xE0 */
-		12,12,8, 4, 0,16, 8,16,12, 8,16, 4, 0, 0, 8,16	/* 0xF0 */
-		/* *INDENT-ON* */
-	};
+		/* If new transfer, call TX function. */
+		if(gb->counter.serial_count == 0 && gb->gb_serial_tx != NULL)
+			(gb->gb_serial_tx)(gb, gb->gb_reg.SB);
 
-	/* Handle interrupts */
-	if((gb->gb_ime || gb->gb_halt) &&
-			(gb->gb_reg.IF & gb->gb_reg.IE & ANY_INTR))
-	{
-		gb->gb_halt = 0;
+		gb->counter.serial_count += cycles;
 
-		if(gb->gb_ime)
+		/* If it's time to receive byte, call RX function. */
+		if(gb->counter.serial_count >= SERIAL_CYCLES)
 		{
-			/* Disable interrupts */
-			gb->gb_ime = 0;
-            
-			/* Push Program Counter */
-			__gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc >> 8);
-			__gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc & 0xFF);
+			/* If RX can be done, do it. */
+			/* If RX failed, do not change SB if using external
+			 * clock, or set to 0xFF if using internal clock. */
+			uint8_t rx;
+
+			if(gb->gb_serial_rx != NULL &&
+			   (gb->gb_serial_rx(gb, &rx) ==
+			    GB_SERIAL_RX_SUCCESS))
+			{
+				gb->gb_reg.SB = rx;
 
-			/* Call interrupt handler if required. */
-			if(gb->gb_reg.IF & gb->gb_reg.IE & VBLANK_INTR)
+				/* Inform game of serial TX/RX completion. */
+				gb->gb_reg.SC &= 0x01;
+				gb->gb_reg.IF |= SERIAL_INTR;
+			}
+			else if(gb->gb_reg.SC & SERIAL_SC_CLOCK_SRC)
 			{
-				gb->cpu_reg.pc = VBLANK_INTR_ADDR;
-				gb->gb_reg.IF ^= VBLANK_INTR;
+				/* If using internal clock, and console is not
+				 * attached to any external peripheral, shifted
+				 * bits are replaced with logic 1. */
+				gb->gb_reg.SB = 0xFF;
+
+				/* Inform game of serial TX/RX completion. */
+				gb->gb_reg.SC &= 0x01;
+				gb->gb_reg.IF |= SERIAL_INTR;
 			}
-			else if(gb->gb_reg.IF & gb->gb_reg.IE & LCDC_INTR)
+			else
 			{
-				gb->cpu_reg.pc = LCDC_INTR_ADDR;
-				gb->gb_reg.IF ^= LCDC_INTR;
+				/* If using external clock, and console is not
+				 * attached to any external peripheral, bits are
+				 * not shifted, so SB is not modified. */
 			}
-			else if(gb->gb_reg.IF & gb->gb_reg.IE & TIMER_INTR)
+
+			gb->counter.serial_count = 0;
+		}
+	}
+
+	/* TIMA register timing */
+	/* TODO: Change tac_enable to struct of TAC timer control bits. */
+	if(gb->gb_reg.tac_enable)
+	{
+		/* TIMA increments every 1024, 16, 64 or 256 cycles. */
+		static const uint_fast8_t TAC_SHIFT[4] = {10, 4, 6, 8};
+		const uint_fast8_t tac_shift = TAC_SHIFT[gb->gb_reg.tac_rate];
+
+		gb->counter.tima_count += cycles;
+
+		uint_fast16_t ticks = gb->counter.tima_count >> tac_shift;
+		gb->counter.tima_count &= (1u << tac_shift) - 1;
+
+		while(ticks >= 0x100u - gb->gb_reg.TIMA)
+		{
+			ticks -= 0x100u - gb->gb_reg.TIMA;
+			gb->gb_reg.IF |= TIMER_INTR;
+			/* On overflow, set TMA to TIMA. */
+			gb->gb_reg.TIMA = gb->gb_reg.TMA;
+		}
+
+		gb->gb_reg.TIMA += ticks;
+	}
+
+	/* TODO Check behaviour of LCD during LCD power off state. */
+	/* If LCD is off, don't update LCD state. */
+	if((gb->gb_reg.LCDC & LCDC_ENABLE) == 0)
+		return;
+
+	/* LCD Timing */
+	gb->counter.lcd_count += cycles;
+
+	/* New Scanline */
+	if(gb->counter.lcd_count > LCD_LINE_CYCLES)
+	{
+		gb->counter.lcd_count -= LCD_LINE_CYCLES;
+
+		/* LYC Update */
+		if(gb->gb_reg.LY == gb->gb_reg.LYC)
+		{
+			gb->gb_reg.STAT |= STAT_LYC_COINC;
+
+			if(gb->gb_reg.STAT & STAT_LYC_INTR)
+				gb->gb_reg.IF |= LCDC_INTR;
+		}
+		else
+			gb->gb_reg.STAT &= 0xFB;
+
+		/* Next line */
+		uint16_t LY_1 = gb->gb_reg.LY + 1;
+		gb->gb_reg.LY = (LY_1 >= LCD_VERT_LINES) ? LY_1 - LCD_VERT_LINES : LY_1;
+
+		/* VBLANK Start */
+		if(gb->gb_reg.LY == LCD_HEIGHT)
+		{
+			gb->lcd_mode = LCD_VBLANK;
+			gb->gb_frame = 1;
+			gb->gb_reg.IF |= VBLANK_INTR;
+			gb->lcd_blank = 0;
+
+			if(gb->gb_reg.STAT & STAT_MODE_1_INTR)
+				gb->gb_reg.IF |= LCDC_INTR;
+
+#if ENABLE_LCD
+			/* If frame skip is activated, count the frame if it was
+			 * skipped. */
+			if(gb->display.frame_skip_count < gb->direct.frame_skip)
+				gb->display.frame_skip_count++;
+			else
 			{
-				gb->cpu_reg.pc = TIMER_INTR_ADDR;
-				gb->gb_reg.IF ^= TIMER_INTR;
+				gb->display.frame_skip_count = 0;
+
+				if(!gb->display.frame_unchanged)
+				{
+					gb->display.back_fb_enabled =
+						!gb->display.back_fb_enabled;
+
+					/* A frame that changed while it was drawn
+					 * may be drawn differently next time. */
+					gb->display.drawn_valid =
+						(gb->display.frame_generation ==
+						 gb->display.generation);
+					gb->display.drawn_generation =
+						gb->display.generation;
+				}
 			}
-			else if(gb->gb_reg.IF & gb->gb_reg.IE & SERIAL_INTR)
+#endif
+		}
+		/* Normal Line */
+		else if(gb->gb_reg.LY < LCD_HEIGHT)
+		{
+			if(gb->gb_reg.LY == 0)
 			{
-				gb->cpu_reg.pc = SERIAL_INTR_ADDR;
-				gb->gb_reg.IF ^= SERIAL_INTR;
+				/* Clear Screen */
+				gb->display.WY = gb->gb_reg.WY;
+				gb->display.window_clear = 0;
+#if ENABLE_LCD
+				gb->display.frame_generation = gb->display.generation;
+				gb->display.frame_unchanged = gb->display.drawn_valid &&
+					gb->display.generation == gb->display.drawn_generation;
+#endif
 			}
-			else if(gb->gb_reg.IF & gb->gb_reg.IE & CONTROL_INTR)
+
+			gb->lcd_mode = LCD_HBLANK;
+
+			if(gb->gb_reg.STAT & STAT_MODE_0_INTR)
+				gb->gb_reg.IF |= LCDC_INTR;
+		}
+	}
+	/* OAM access */
+	else if(gb->lcd_mode == LCD_HBLANK
+		&& gb->counter.lcd_count >= LCD_MODE_2_CYCLES)
+	{
+		gb->lcd_mode = LCD_SEARCH_OAM;
+
+		if(gb->gb_reg.STAT & STAT_MODE_2_INTR)
+			gb->gb_reg.IF |= LCDC_INTR;
+	}
+	/* Update LCD */
+	else if(gb->lcd_mode == LCD_SEARCH_OAM
+		&& gb->counter.lcd_count >= LCD_MODE_3_CYCLES)
+	{
+		gb->lcd_mode = LCD_TRANSFER;
+#if ENABLE_LCD
+		if(!gb->lcd_blank &&
+		   gb->display.frame_skip_count >= gb->direct.frame_skip)
+			__gb_draw_line(gb);
+#endif
+	}
+}
+
+/**
+ * Internal function used to calculate how many cycles may be executed before
+ * __gb_sync_counters() has to be called again. Must be called whenever the
+ * counters were synchronised or a register affecting them was written.
+ *
+ * DIV has no event of its own. It is only brought up to date when it is read,
+ * or along with any other event.
+ */
+void __gb_schedule_next_event(struct gb_s *gb)
+{
+	uint_fast32_t next = EVENT_MAX_CYCLES;
+
+	/* End of the serial transfer. A new transfer is started on the next
+	 * update of the counters. */
+	if(gb->gb_reg.SC & SERIAL_SC_TX_START)
+	{
+		if(gb->counter.serial_count == 0)
+			next = 1;
+		else if(SERIAL_CYCLES - gb->counter.serial_count < next)
+			next = SERIAL_CYCLES - gb->counter.serial_count;
+	}
+
+	/* TIMA overflow. */
+	if(gb->gb_reg.tac_enable)
+	{
+		static const uint_fast8_t TAC_SHIFT[4] = {10, 4, 6, 8};
+		const uint_fast32_t tima_cycles =
+			((0x100u - gb->gb_reg.TIMA) << TAC_SHIFT[gb->gb_reg.tac_rate])
+			- gb->counter.tima_count;
+
+		if(tima_cycles < next)
+			next = tima_cycles;
+	}
+
+	/* Next LCD mode change or scanline. */
+	if(gb->gb_reg.LCDC & LCDC_ENABLE)
+	{
+		uint_fast16_t lcd_target = LCD_LINE_CYCLES + 1;
+
+		if(gb->lcd_mode == LCD_HBLANK)
+			lcd_target = LCD_MODE_2_CYCLES;
+		else if(gb->lcd_mode == LCD_SEARCH_OAM)
+			lcd_target = LCD_MODE_3_CYCLES;
+
+		if(gb->counter.lcd_count >= lcd_target)
+			next = 1;
+		else if(lcd_target - gb->counter.lcd_count < next)
+			next = lcd_target - gb->counter.lcd_count;
+	}
+
+#if PEANUT_GB_BLOCK_CACHE
+	/* An interrupt became pending, take it before the next instruction. */
+	if(gb->gb_ime && (gb->gb_reg.IF & gb->gb_reg.IE & ANY_INTR))
+		next = 0;
+#endif
+
+	gb->counter.next_event = next;
+}
+
+/* Length in bytes of each instruction, including its opcode. */
+static const uint8_t op_length[0x100] =
+{
+	/* *INDENT-OFF* */
+	/*0 1 2 3 4 5 6 7 8 9 A B C D E F	*/
+	1,3,1,1,1,1,2,1,3,1,1,1,1,1,2,1,	/* 0x00 */
+	1,3,1,1,1,1,2,1,2,1,1,1,1,1,2,1,	/* 0x10 */
+	2,3,1,1,1,1,2,1,2,1,1,1,1,1,2,1,	/* 0x20 */
+	2,3,1,1,1,1,2,1,2,1,1,1,1,1,2,1,	/* 0x30 */
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,	/* 0x40 */
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,	/* 0x50 */
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,	/* 0x60 */
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,	/* 0x70 */
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,	/* 0x80 */
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,	/* 0x90 */
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,	/* 0xA0 */
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,	/* 0xB0 */
+	1,1,3,3,3,1,2,1,1,1,3,2,3,3,2,1,	/* 0xC0 */
+	1,1,3,1,3,1,2,1,1,1,3,1,3,1,2,1,	/* 0xD0 */
+	2,1,1,1,1,1,2,1,2,1,3,1,1,1,2,1,	/* 0xE0 */
+	2,1,1,1,1,1,2,1,2,1,3,1,1,1,2,1	/* 0xF0 */
+	/* *INDENT-ON* */
+};
+
+#if PEANUT_GB_BLOCK_CACHE
+/**
+ * Internal function used to find the block starting at the program counter,
+ * decoding it if it is not cached. Returns NULL if the code cannot be cached.
+ */
+const struct gb_block_s *__gb_get_block(struct gb_s *gb,
+		const void * const *op_table)
+{
+	struct gb_block_cache_s *cache = gb->block_cache;
+	const uint_fast16_t pc = gb->cpu_reg.pc;
+	const uint8_t *page = gb->read_map[pc >> 12];
+	struct gb_block_s *block;
+	uint32_t generation = 0;
+	uint_fast16_t addr;
+	uint_fast16_t limit;
+
+	/* Only ROM, WRAM and HRAM code is cached. */
+	if(pc >= VRAM_ADDR && (pc < WRAM_0_ADDR || pc >= ECHO_ADDR) &&
+			(pc < HRAM_ADDR || pc == INTR_EN_ADDR))
+		return NULL;
+
+	if(pc >= HRAM_ADDR)
+		generation = cache->hram_generation;
+	else if(pc >= WRAM_0_ADDR)
+		generation = cache->wram_generation[(pc - WRAM_0_ADDR) >> 8];
+
+	block = &cache->blocks[(pc ^ ((uintptr_t)page >> 14) * 0x61) &
+				(GB_BLOCK_CACHE_SIZE - 1)];
+
+	if(block->count != 0 && block->pc == pc && block->page == page &&
+			block->generation == generation)
+	{
+		cache->hits++;
+		return block;
+	}
+
+	cache->misses++;
+
+	/* Blocks do not cross 4 KiB pages, which may be banked separately,
+	 * nor WRAM pages, which are invalidated separately. */
+	if(pc >= HRAM_ADDR)
+		limit = INTR_EN_ADDR;
+	else if(pc >= WRAM_0_ADDR)
+		limit = (pc | 0x00FF) + 1;
+	else
+		limit = (pc | 0x0FFF) + 1;
+
+	addr = pc;
+	block->page = page;
+	block->generation = generation;
+	block->pc = pc;
+	block->count = 0;
+
+	while(block->count < GB_BLOCK_MAX_OPS)
+	{
+		const uint8_t opcode = __gb_read(gb, addr);
+		const uint8_t length = op_length[opcode];
+		struct gb_block_op_s *op;
+
+		if(addr + length > limit)
+			break;
+
+		op = &block->ops[block->count++];
+		op->handler = op_table[opcode];
+		op->opcode = opcode;
+		op->length = length;
+		op->imm = 0;
+
+		if(length > 1)
+			op->imm = __gb_read(gb, addr + 1);
+
+		if(length > 2)
+			op->imm |= __gb_read(gb, addr + 2) << 8;
+
+		addr += length;
+
+		/* End the block on jumps, calls, returns, HALT, STOP, on
+		 * changes to IME and on invalid opcodes. */
+		switch(opcode)
+		{
+		case 0x10: case 0x18: case 0x20: case 0x28: case 0x30:
+		case 0x38: case 0x76: case 0xC0: case 0xC2: case 0xC3:
+		case 0xC4: case 0xC7: case 0xC8: case 0xC9: case 0xCA:
+		case 0xCC: case 0xCD: case 0xCF: case 0xD0: case 0xD2:
+		case 0xD3: case 0xD4: case 0xD7: case 0xD8: case 0xD9:
+		case 0xDA: case 0xDB: case 0xDC: case 0xDD: case 0xDF:
+		case 0xE3: case 0xE4: case 0xE7: case 0xE9: case 0xEB:
+		case 0xEC: case 0xED: case 0xEF: case 0xF3: case 0xF4:
+		case 0xF7: case 0xFB: case 0xFC: case 0xFD: case 0xFF:
+			limit = addr;
+			break;
+		}
+
+		if(addr >= limit)
+			break;
+	}
+
+	if(block->count == 0)
+		return NULL;
+
+	block->end = addr - 1;
+
+	/* Mark the RAM holding the code, so that writes to it invalidate
+	 * the block. */
+	if(pc >= HRAM_ADDR)
+	{
+		for(uint_fast16_t i = pc - HRAM_ADDR; i < addr - HRAM_ADDR; i++)
+			cache->hram_code[i >> 5] |= (uint32_t)1 << (i & 31);
+	}
+	else if(pc >= WRAM_0_ADDR)
+	{
+		const uint32_t wram_code = cache->wram_code;
+
+		for(uint_fast16_t i = pc - WRAM_0_ADDR; i < addr - WRAM_0_ADDR; i++)
+			cache->wram_code_bytes[i >> 5] |= (uint32_t)1 << (i & 31);
+
+		cache->wram_code |= (uint32_t)1 << ((pc - WRAM_0_ADDR) >> 8);
+
+		if(__gb_code_pages_changed(wram_code, cache->wram_code))
+			__gb_update_memory_map(gb);
+	}
+
+	return block;
+}
+#endif
+
+/**
+ * Internal function used to check whether an instruction may be part of an
+ * idle loop: it must not write to memory, use the stack, change the flow of
+ * execution or read registers that change without an event.
+ * Returns the number of cycles the instruction takes, or 0 if it may not.
+ */
+uint_fast8_t __gb_idle_op_cycles(const uint8_t opcode, const uint16_t imm,
+		const uint8_t *op_cycles)
+{
+	switch(opcode)
+	{
+	/* Writes to memory. */
+	case 0x02: case 0x08: case 0x12: case 0x22: case 0x32: case 0x34:
+	case 0x35: case 0x36: case 0x70: case 0x71: case 0x72: case 0x73:
+	case 0x74: case 0x75: case 0x77: case 0xE0: case 0xE2: case 0xEA:
+
+	/* Stack. */
+	case 0xC1: case 0xC5: case 0xD1: case 0xD5: case 0xE1: case 0xE5:
+	case 0xF1: case 0xF5:
+
+	/* Jumps, calls, returns and HALT, STOP, DI, EI. */
+	case 0x10: case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+	case 0x76: case 0xC0: case 0xC2: case 0xC3: case 0xC4: case 0xC7:
+	case 0xC8: case 0xC9: case 0xCA: case 0xCC: case 0xCD: case 0xCF:
+	case 0xD0: case 0xD2: case 0xD4: case 0xD7: case 0xD8: case 0xD9:
+	case 0xDA: case 0xDC: case 0xDF: case 0xE7: case 0xE9: case 0xEF:
+	case 0xF3: case 0xF7: case 0xFB: case 0xFF:
+
+	/* Invalid opcodes. */
+	case 0xD3: case 0xDB: case 0xDD: case 0xE3: case 0xE4: case 0xEB:
+	case 0xEC: case 0xED: case 0xF4: case 0xFC: case 0xFD:
+		return 0;
+
+	case 0xCB:
+		/* Only BIT reads (HL) without writing it back. */
+		if((imm & 0x07) == 0x06)
+			return (imm & 0xC0) == 0x40 ? 12 : 0;
+
+		return 8;
+
+	case 0xF0:
+	case 0xFA:
+	{
+		const uint_fast16_t addr = opcode == 0xF0 ? 0xFF00 | imm : imm;
+
+		/* DIV, TIMA and sound registers change with time. */
+		if(addr == 0xFF04 || addr == 0xFF05 ||
+				(addr >= 0xFF10 && addr <= 0xFF3F))
+			return 0;
+
+		return op_cycles[opcode];
+	}
+
+	default:
+		return op_cycles[opcode];
+	}
+}
+
+#if PEANUT_GB_PROFILE
+/**
+ * Internal function used to add an executed instruction to the profile. pc is
+ * the address of the instruction.
+ */
+void __gb_profile_op(struct gb_s *gb, const uint16_t pc, const uint8_t opcode,
+		const uint_fast8_t cycles)
+{
+	struct gb_profile_s *profile = gb->profile;
+	uint16_t bank = 0;
+	uint_fast16_t slot;
+
+	profile->op_count[opcode]++;
+	profile->op_cycles[opcode] += cycles;
+
+	if(profile->sample_countdown != 0)
+	{
+		profile->sample_countdown--;
+		return;
+	}
+
+	profile->sample_countdown = GB_PROFILE_PC_PERIOD - 1;
+
+	if(pc >= ROM_BANK_SIZE && pc < VRAM_ADDR)
+		bank = (gb->read_map[0x4] - gb->gb_rom) / ROM_BANK_SIZE;
+
+	/* Open addressing with linear probing. */
+	slot = ((pc * 0x9E37u) ^ (bank * 0x45D9u)) & (GB_PROFILE_PC_SLOTS - 1);
+
+	for(uint_fast16_t i = 0; i < GB_PROFILE_PC_SLOTS; i++)
+	{
+		if(profile->pc_samples[slot].count == 0)
+		{
+			profile->pc_samples[slot].bank = bank;
+			profile->pc_samples[slot].pc = pc;
+		}
+		else if(profile->pc_samples[slot].bank != bank ||
+				profile->pc_samples[slot].pc != pc)
+		{
+			slot = (slot + 1) & (GB_PROFILE_PC_SLOTS - 1);
+			continue;
+		}
+
+		profile->pc_samples[slot].count++;
+		return;
+	}
+
+	profile->dropped_samples++;
+}
+#endif
+
+/**
+ * Internal function used to skip through idle loops. Called when the jump at
+ * branch back to target is taken, before the program counter is changed. sp is
+ * the current stack pointer, which the CPU holds outside of gb->cpu_reg.
+ *
+ * An idle loop only reads memory and registers that do not change until the
+ * next LCD, timer or serial event, so if an iteration left the CPU state
+ * unchanged, every following iteration will too until that event. These
+ * iterations are skipped by adding their cycles at once. The loop then runs
+ * on as usual, so the event happens on the same instruction as it would have.
+ */
+void __gb_skip_idle_loop(struct gb_s *gb, const uint16_t target,
+		const uint16_t branch, const uint16_t sp,
+		const uint_fast8_t branch_cycles, const uint8_t *op_cycles)
+{
+	const uint8_t *page = gb->read_map[target >> 12];
+	const uint_fast16_t length =
+		branch - target + op_length[__gb_read(gb, branch)];
+	uint_fast8_t seen = gb->idle.pc == target &&
+		gb->idle.branch == branch && gb->idle.page == page;
+
+	__GB_FLAGS(gb);
+
+	/* Code outside of ROM may have been modified since the loop was
+	 * checked, so it is compared with the copy taken then. */
+	if(seen && target >= VRAM_ADDR)
+	{
+		seen = gb->idle.cycles != 0 && length <= sizeof(gb->idle.code);
+
+		for(uint_fast16_t i = 0; seen && i < length; i++)
+			seen = __gb_read(gb, target + i) == gb->idle.code[i];
+	}
+
+	if(!seen)
+	{
+		/* A new loop. */
+		uint_fast16_t addr = target;
+		uint_fast16_t cycles = branch_cycles;
+
+		while(cycles != 0 && addr < branch)
+		{
+			const uint8_t opcode = __gb_read(gb, addr);
+			uint16_t imm = 0;
+			uint_fast8_t op;
+
+			if(op_length[opcode] > 1)
+				imm = __gb_read(gb, addr + 1);
+
+			if(op_length[opcode] > 2)
+				imm |= __gb_read(gb, addr + 2) << 8;
+
+			op = __gb_idle_op_cycles(opcode, imm, op_cycles);
+			cycles = op != 0 ? cycles + op : 0;
+			addr += op_length[opcode];
+		}
+
+		gb->idle.page = page;
+		gb->idle.pc = target;
+		gb->idle.branch = branch;
+		gb->idle.cycles = addr == branch ? cycles : 0;
+
+		if(target >= VRAM_ADDR)
+		{
+			if(length > sizeof(gb->idle.code))
+				gb->idle.cycles = 0;
+
+			for(uint_fast16_t i = 0;
+					i < length && i < sizeof(gb->idle.code); i++)
+				gb->idle.code[i] = __gb_read(gb, target + i);
+		}
+	}
+	else if(gb->idle.cycles != 0 &&
+			gb->counter.pending_cycles ==
+				gb->idle.pending_cycles + gb->idle.cycles &&
+			gb->cpu_reg.af == gb->idle.af &&
+			gb->cpu_reg.bc == gb->idle.bc &&
+			gb->cpu_reg.de == gb->idle.de &&
+			gb->cpu_reg.hl == gb->idle.hl &&
+			sp == gb->idle.sp)
+	{
+		/* The last iteration ran without an event and changed nothing.
+		 * Skip the iterations that end before the next event. */
+		const uint_fast16_t now = gb->counter.pending_cycles + branch_cycles;
+
+		if(gb->counter.next_event > now)
+		{
+			const uint_fast16_t skip =
+				(gb->counter.next_event - 1 - now) / gb->idle.cycles;
+
+			if(skip != 0)
 			{
-				gb->cpu_reg.pc = CONTROL_INTR_ADDR;
-				gb->gb_reg.IF ^= CONTROL_INTR;
+				gb->counter.pending_cycles += skip * gb->idle.cycles;
+				gb->idle.loops++;
+				gb->idle.skipped_cycles += skip * gb->idle.cycles;
 			}
 		}
 	}
-    
-	/* Obtain opcode */
-    uint8_t opcode = (gb->gb_halt ? 0x00 : __gb_read(gb, gb->cpu_reg.pc++));
-    uint8_t inst_cycles = op_cycles[opcode];
-    
-    /* Execute opcode */
-    
+
+	gb->idle.pending_cycles = gb->counter.pending_cycles;
+	gb->idle.af = gb->cpu_reg.af;
+	gb->idle.bc = gb->cpu_reg.bc;
+	gb->idle.de = gb->cpu_reg.de;
+	gb->idle.hl = gb->cpu_reg.hl;
+	gb->idle.sp = sp;
+}
+
+/**
+ * Internal function used to run the CPU until the end of the frame.
+ *
+ * The program counter and stack pointer are kept in local variables so that
+ * they can stay in registers across instructions. They are only written back
+ * to gb->cpu_reg for the functions that use them, and on return.
+ */
+void __gb_run_cpu(struct gb_s *gb)
+{
+	static const uint8_t op_cycles[0x100] =
+	{
+		/* *INDENT-OFF* */
+		/*0 1 2  3  4  5  6  7  8  9  A  B  C  D  E  F	*/
+		4,12, 8, 8, 4, 4, 8, 4,20, 8, 8, 8, 4, 4, 8, 4,	/* 0x00 */
+		4,12, 8, 8, 4, 4, 8, 4,12, 8, 8, 8, 4, 4, 8, 4,	/* 0x10 */
+		8,12, 8, 8, 4, 4, 8, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x20 */
+		8,12, 8, 8,12,12,12, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x30 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x40 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x50 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x60 */
+		8, 8, 8, 8, 8, 8, 4, 8, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x70 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x80 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x90 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xA0 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xB0 */
+		8,12,12,16,12,16, 8,16, 8,16,12, 8,12,24, 8,16,	/* 0xC0 */
+		8,12,12, 0,12,16, 8,16, 8,16,12, 0,12, 0, 8,16,	/* 0xD0 */
+		12,12,8, 0, 0,16, 8,16,16, 4,16, 0, 0, 0, 8,16,	/* 0xE0 */
+		12,12,8, 4, 0,16, 8,16,12, 8,16, 4, 0, 0, 8,16	/* 0xF0 */
+		/* *INDENT-ON* */
+	};
+
     static const void* op_table[256] = {
         &&exit, &&_0x01, &&_0x02, &&_0x03, &&_0x04, &&_0x05, &&_0x06, &&_0x07, &&_0x08, &&_0x09,
         &&_0x0A, &&_0x0B, &&_0x0C, &&_0x0D, &&_0x0E, &&_0x0F, &&_0x10, &&_0x11, &&_0x12, &&_0x13,
@@ -1599,16 +3430,150 @@ void __gb_step_cpu(struct gb_s *gb)
         &&_0xF0, &&_0xF1, &&_0xF2, &&_0xF3, &&_invalid, &&_0xF5, &&_0xF6, &&_0xF7, &&_0xF8, &&_0xF9,
         &&_0xFA, &&_0xFB, &&_invalid, &&_invalid, &&_0xFE, &&_0xFF
     };
+
+	uint16_t pc = gb->cpu_reg.pc;
+	uint16_t sp = gb->cpu_reg.sp;
+	uint8_t opcode;
+	uint16_t imm;
+	uint8_t inst_cycles;
+#if PEANUT_GB_BLOCK_CACHE
+	const struct gb_block_op_s *op;
+	const struct gb_block_op_s *op_end;
+#endif
+#if PEANUT_GB_PROFILE
+	uint16_t op_pc;
+#endif
+
+next_step:
+	/* Handle interrupts */
+	if((gb->gb_ime || gb->gb_halt) &&
+			(gb->gb_reg.IF & gb->gb_reg.IE & ANY_INTR))
+	{
+		gb->gb_halt = 0;
+
+		if(gb->gb_ime)
+		{
+			/* Disable interrupts */
+			gb->gb_ime = 0;
+            
+			/* Push Program Counter */
+			__gb_write(gb, --sp, pc >> 8);
+			__gb_write(gb, --sp, pc & 0xFF);
+
+			/* Call interrupt handler if required. */
+			if(gb->gb_reg.IF & gb->gb_reg.IE & VBLANK_INTR)
+			{
+				pc = VBLANK_INTR_ADDR;
+				gb->gb_reg.IF ^= VBLANK_INTR;
+			}
+			else if(gb->gb_reg.IF & gb->gb_reg.IE & LCDC_INTR)
+			{
+				pc = LCDC_INTR_ADDR;
+				gb->gb_reg.IF ^= LCDC_INTR;
+			}
+			else if(gb->gb_reg.IF & gb->gb_reg.IE & TIMER_INTR)
+			{
+				pc = TIMER_INTR_ADDR;
+				gb->gb_reg.IF ^= TIMER_INTR;
+			}
+			else if(gb->gb_reg.IF & gb->gb_reg.IE & SERIAL_INTR)
+			{
+				pc = SERIAL_INTR_ADDR;
+				gb->gb_reg.IF ^= SERIAL_INTR;
+			}
+			else if(gb->gb_reg.IF & gb->gb_reg.IE & CONTROL_INTR)
+			{
+				pc = CONTROL_INTR_ADDR;
+				gb->gb_reg.IF ^= CONTROL_INTR;
+			}
+		}
+	}
     
+    
+#if PEANUT_GB_BLOCK_CACHE
+	op = NULL;
+	op_end = NULL;
+#endif
+
+	if(gb->gb_halt)
+	{
+		/* Nothing can wake the CPU before the next event, so skip to it
+		 * at once. Time passes in steps of 4 cycles, as if executing
+		 * NOPs. */
+		uint_fast16_t halt_cycles = 4;
+
+		if(gb->counter.next_event > gb->counter.pending_cycles)
+			halt_cycles = (gb->counter.next_event -
+				gb->counter.pending_cycles + 3) & ~(uint_fast16_t)3;
+
+		gb->counter.pending_cycles += halt_cycles;
+#if PEANUT_GB_PROFILE
+		if(gb->profile != NULL)
+			gb->profile->halt_cycles += halt_cycles;
+#endif
+		__gb_sync_counters(gb);
+		__gb_schedule_next_event(gb);
+		goto step_end;
+	}
+
+#if PEANUT_GB_BLOCK_CACHE
+	if(gb->block_cache != NULL)
+	{
+		const struct gb_block_s *block;
+
+		gb->cpu_reg.pc = pc;
+		block = __gb_get_block(gb, op_table);
+
+		if(block != NULL)
+		{
+			op = block->ops;
+			op_end = op + block->count;
+			goto next_op;
+		}
+	}
+#endif
+
+#if PEANUT_GB_PROFILE
+	op_pc = pc;
+#endif
+
+	/* Obtain opcode */
+	opcode = __gb_read(gb, pc++);
+	imm = 0;
+
+	/* Fetch the immediate operand. */
+	if(op_length[opcode] > 1)
+		imm = __gb_read(gb, pc++);
+
+	if(op_length[opcode] > 2)
+		imm |= __gb_read(gb, pc++) << 8;
+
+	inst_cycles = op_cycles[opcode];
+
+    /* Execute opcode */
     goto *op_table[opcode];
+
+#if PEANUT_GB_BLOCK_CACHE
+    next_op: {
+        /* Execute the next pre-decoded opcode of the block. */
+        opcode = op->opcode;
+        imm = op->imm;
+#if PEANUT_GB_PROFILE
+        op_pc = pc;
+#endif
+        pc += op->length;
+        inst_cycles = op_cycles[opcode];
+        goto *op->handler;
+    }
+#endif
+    
     
     _0x00: { /* NOP */
         goto exit;
     }
 
     _0x01: { /* LD BC, imm */
-        gb->cpu_reg.c = __gb_read(gb, gb->cpu_reg.pc++);
-        gb->cpu_reg.b = __gb_read(gb, gb->cpu_reg.pc++);
+        gb->cpu_reg.bc = imm;
         goto exit;
     }
 
@@ -1624,26 +3589,23 @@ void __gb_step_cpu(struct gb_s *gb)
 
     _0x04: { /* INC B */
         gb->cpu_reg.b++;
-        gb->cpu_reg.f_bits.z = (gb->cpu_reg.b == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h = ((gb->cpu_reg.b & 0x0F) == 0x00);
+        __GB_INC_FLAGS(gb, gb->cpu_reg.b);
         goto exit;
     }
 
     _0x05: { /* DEC B */
         gb->cpu_reg.b--;
-        gb->cpu_reg.f_bits.z = (gb->cpu_reg.b == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h = ((gb->cpu_reg.b & 0x0F) == 0x0F);
+        __GB_DEC_FLAGS(gb, gb->cpu_reg.b);
         goto exit;
     }
 
     _0x06: { /* LD B, imm */
-        gb->cpu_reg.b = __gb_read(gb, gb->cpu_reg.pc++);
+        gb->cpu_reg.b = imm;
         goto exit;
     }
 
     _0x07: { /* RLCA */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = (gb->cpu_reg.a << 1) | (gb->cpu_reg.a >> 7);
         gb->cpu_reg.f_bits.z = 0;
         gb->cpu_reg.f_bits.n = 0;
@@ -1653,14 +3615,14 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0x08: { /* LD (imm), SP */
-        uint16_t temp = __gb_read(gb, gb->cpu_reg.pc++);
-        temp |= __gb_read(gb, gb->cpu_reg.pc++) << 8;
-        __gb_write(gb, temp++, gb->cpu_reg.sp & 0xFF);
-        __gb_write(gb, temp, gb->cpu_reg.sp >> 8);
+        uint16_t temp = imm;
+        __gb_write(gb, temp++, sp & 0xFF);
+        __gb_write(gb, temp, sp >> 8);
         goto exit;
     }
 
     _0x09: { /* ADD HL, BC */
+        __GB_FLAGS(gb);
         uint_fast32_t temp = gb->cpu_reg.hl + gb->cpu_reg.bc;
         gb->cpu_reg.f_bits.n = 0;
         gb->cpu_reg.f_bits.h =
@@ -1682,26 +3644,23 @@ void __gb_step_cpu(struct gb_s *gb)
 
     _0x0C: { /* INC C */
         gb->cpu_reg.c++;
-        gb->cpu_reg.f_bits.z = (gb->cpu_reg.c == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h = ((gb->cpu_reg.c & 0x0F) == 0x00);
+        __GB_INC_FLAGS(gb, gb->cpu_reg.c);
         goto exit;
     }
 
     _0x0D: { /* DEC C */
         gb->cpu_reg.c--;
-        gb->cpu_reg.f_bits.z = (gb->cpu_reg.c == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h = ((gb->cpu_reg.c & 0x0F) == 0x0F);
+        __GB_DEC_FLAGS(gb, gb->cpu_reg.c);
         goto exit;
     }
 
     _0x0E: { /* LD C, imm */
-        gb->cpu_reg.c = __gb_read(gb, gb->cpu_reg.pc++);
+        gb->cpu_reg.c = imm;
         goto exit;
     }
 
     _0x0F: { /* RRCA */
+        __GB_FLAGS(gb);
         gb->cpu_reg.f_bits.c = gb->cpu_reg.a & 0x01;
         gb->cpu_reg.a = (gb->cpu_reg.a >> 1) | (gb->cpu_reg.a << 7);
         gb->cpu_reg.f_bits.z = 0;
@@ -1716,8 +3675,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0x11: { /* LD DE, imm */
-        gb->cpu_reg.e = __gb_read(gb, gb->cpu_reg.pc++);
-        gb->cpu_reg.d = __gb_read(gb, gb->cpu_reg.pc++);
+        gb->cpu_reg.de = imm;
         goto exit;
     }
 
@@ -1733,26 +3691,23 @@ void __gb_step_cpu(struct gb_s *gb)
 
     _0x14: { /* INC D */
         gb->cpu_reg.d++;
-        gb->cpu_reg.f_bits.z = (gb->cpu_reg.d == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h = ((gb->cpu_reg.d & 0x0F) == 0x00);
+        __GB_INC_FLAGS(gb, gb->cpu_reg.d);
         goto exit;
     }
 
     _0x15: { /* DEC D */
         gb->cpu_reg.d--;
-        gb->cpu_reg.f_bits.z = (gb->cpu_reg.d == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h = ((gb->cpu_reg.d & 0x0F) == 0x0F);
+        __GB_DEC_FLAGS(gb, gb->cpu_reg.d);
         goto exit;
     }
 
     _0x16: { /* LD D, imm */
-        gb->cpu_reg.d = __gb_read(gb, gb->cpu_reg.pc++);
+        gb->cpu_reg.d = imm;
         goto exit;
     }
 
     _0x17: { /* RLA */
+        __GB_FLAGS(gb);
         uint8_t temp = gb->cpu_reg.a;
         gb->cpu_reg.a = (gb->cpu_reg.a << 1) | gb->cpu_reg.f_bits.c;
         gb->cpu_reg.f_bits.z = 0;
@@ -1763,12 +3718,18 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0x18: { /* JR imm */
-        int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc++);
-        gb->cpu_reg.pc += temp;
+        int8_t temp = (int8_t) imm;
+
+        if(temp < 0 && gb->direct.idle_skip)
+            __gb_skip_idle_loop(gb, pc + temp,
+                    pc - 2, sp, inst_cycles, op_cycles);
+
+        pc += temp;
         goto exit;
     }
 
     _0x19: { /* ADD HL, DE */
+        __GB_FLAGS(gb);
         uint_fast32_t temp = gb->cpu_reg.hl + gb->cpu_reg.de;
         gb->cpu_reg.f_bits.n = 0;
         gb->cpu_reg.f_bits.h =
@@ -1790,26 +3751,23 @@ void __gb_step_cpu(struct gb_s *gb)
 
     _0x1C: { /* INC E */
         gb->cpu_reg.e++;
-        gb->cpu_reg.f_bits.z = (gb->cpu_reg.e == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h = ((gb->cpu_reg.e & 0x0F) == 0x00);
+        __GB_INC_FLAGS(gb, gb->cpu_reg.e);
         goto exit;
     }
 
     _0x1D: { /* DEC E */
         gb->cpu_reg.e--;
-        gb->cpu_reg.f_bits.z = (gb->cpu_reg.e == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h = ((gb->cpu_reg.e & 0x0F) == 0x0F);
+        __GB_DEC_FLAGS(gb, gb->cpu_reg.e);
         goto exit;
     }
 
     _0x1E: { /* LD E, imm */
-        gb->cpu_reg.e = __gb_read(gb, gb->cpu_reg.pc++);
+        gb->cpu_reg.e = imm;
         goto exit;
     }
 
     _0x1F: { /* RRA */
+        __GB_FLAGS(gb);
         uint8_t temp = gb->cpu_reg.a;
         gb->cpu_reg.a = gb->cpu_reg.a >> 1 | (gb->cpu_reg.f_bits.c << 7);
         gb->cpu_reg.f_bits.z = 0;
@@ -1820,21 +3778,24 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0x20: { /* JP NZ, imm */
+        __GB_FLAGS(gb);
         if(!gb->cpu_reg.f_bits.z)
         {
-            int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc++);
-            gb->cpu_reg.pc += temp;
+            int8_t temp = (int8_t) imm;
             inst_cycles += 4;
+
+            if(temp < 0 && gb->direct.idle_skip)
+                __gb_skip_idle_loop(gb, pc + temp,
+                        pc - 2, sp, inst_cycles, op_cycles);
+
+            pc += temp;
         }
-        else
-            gb->cpu_reg.pc++;
 
         goto exit;
     }
 
     _0x21: { /* LD HL, imm */
-        gb->cpu_reg.l = __gb_read(gb, gb->cpu_reg.pc++);
-        gb->cpu_reg.h = __gb_read(gb, gb->cpu_reg.pc++);
+        gb->cpu_reg.hl = imm;
         goto exit;
     }
 
@@ -1851,26 +3812,23 @@ void __gb_step_cpu(struct gb_s *gb)
 
     _0x24: { /* INC H */
         gb->cpu_reg.h++;
-        gb->cpu_reg.f_bits.z = (gb->cpu_reg.h == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h = ((gb->cpu_reg.h & 0x0F) == 0x00);
+        __GB_INC_FLAGS(gb, gb->cpu_reg.h);
         goto exit;
     }
 
     _0x25: { /* DEC H */
         gb->cpu_reg.h--;
-        gb->cpu_reg.f_bits.z = (gb->cpu_reg.h == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h = ((gb->cpu_reg.h & 0x0F) == 0x0F);
+        __GB_DEC_FLAGS(gb, gb->cpu_reg.h);
         goto exit;
     }
 
     _0x26: { /* LD H, imm */
-        gb->cpu_reg.h = __gb_read(gb, gb->cpu_reg.pc++);
+        gb->cpu_reg.h = imm;
         goto exit;
     }
 
     _0x27: { /* DAA */
+        __GB_FLAGS(gb);
         uint16_t a = gb->cpu_reg.a;
 
         if(gb->cpu_reg.f_bits.n)
@@ -1901,19 +3859,24 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0x28: { /* JP Z, imm */
+        __GB_FLAGS(gb);
         if(gb->cpu_reg.f_bits.z)
         {
-            int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc++);
-            gb->cpu_reg.pc += temp;
+            int8_t temp = (int8_t) imm;
             inst_cycles += 4;
+
+            if(temp < 0 && gb->direct.idle_skip)
+                __gb_skip_idle_loop(gb, pc + temp,
+                        pc - 2, sp, inst_cycles, op_cycles);
+
+            pc += temp;
         }
-        else
-            gb->cpu_reg.pc++;
 
         goto exit;
     }
 
     _0x29: { /* ADD HL, HL */
+        __GB_FLAGS(gb);
         uint_fast32_t temp = gb->cpu_reg.hl + gb->cpu_reg.hl;
         gb->cpu_reg.f_bits.n = 0;
         gb->cpu_reg.f_bits.h = (temp & 0x1000) ? 1 : 0;
@@ -1934,26 +3897,23 @@ void __gb_step_cpu(struct gb_s *gb)
 
     _0x2C: { /* INC L */
         gb->cpu_reg.l++;
-        gb->cpu_reg.f_bits.z = (gb->cpu_reg.l == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h = ((gb->cpu_reg.l & 0x0F) == 0x00);
+        __GB_INC_FLAGS(gb, gb->cpu_reg.l);
         goto exit;
     }
 
     _0x2D: { /* DEC L */
         gb->cpu_reg.l--;
-        gb->cpu_reg.f_bits.z = (gb->cpu_reg.l == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h = ((gb->cpu_reg.l & 0x0F) == 0x0F);
+        __GB_DEC_FLAGS(gb, gb->cpu_reg.l);
         goto exit;
     }
 
     _0x2E: { /* LD L, imm */
-        gb->cpu_reg.l = __gb_read(gb, gb->cpu_reg.pc++);
+        gb->cpu_reg.l = imm;
         goto exit;
     }
 
     _0x2F: { /* CPL */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = ~gb->cpu_reg.a;
         gb->cpu_reg.f_bits.n = 1;
         gb->cpu_reg.f_bits.h = 1;
@@ -1961,21 +3921,24 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0x30: { /* JP NC, imm */
+        __GB_FLAGS(gb);
         if(!gb->cpu_reg.f_bits.c)
         {
-            int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc++);
-            gb->cpu_reg.pc += temp;
+            int8_t temp = (int8_t) imm;
             inst_cycles += 4;
+
+            if(temp < 0 && gb->direct.idle_skip)
+                __gb_skip_idle_loop(gb, pc + temp,
+                        pc - 2, sp, inst_cycles, op_cycles);
+
+            pc += temp;
         }
-        else
-            gb->cpu_reg.pc++;
 
         goto exit;
     }
 
     _0x31: { /* LD SP, imm */
-        gb->cpu_reg.sp = __gb_read(gb, gb->cpu_reg.pc++);
-        gb->cpu_reg.sp |= __gb_read(gb, gb->cpu_reg.pc++) << 8;
+        sp = imm;
         goto exit;
     }
 
@@ -1986,34 +3949,31 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0x33: { /* INC SP */
-        gb->cpu_reg.sp++;
+        sp++;
         goto exit;
     }
 
     _0x34: { /* INC (HL) */
         uint8_t temp = __gb_read(gb, gb->cpu_reg.hl) + 1;
-        gb->cpu_reg.f_bits.z = (temp == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h = ((temp & 0x0F) == 0x00);
+        __GB_INC_FLAGS(gb, temp);
         __gb_write(gb, gb->cpu_reg.hl, temp);
         goto exit;
     }
 
     _0x35: { /* DEC (HL) */
         uint8_t temp = __gb_read(gb, gb->cpu_reg.hl) - 1;
-        gb->cpu_reg.f_bits.z = (temp == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h = ((temp & 0x0F) == 0x0F);
+        __GB_DEC_FLAGS(gb, temp);
         __gb_write(gb, gb->cpu_reg.hl, temp);
         goto exit;
     }
 
     _0x36: { /* LD (HL), imm */
-        __gb_write(gb, gb->cpu_reg.hl, __gb_read(gb, gb->cpu_reg.pc++));
+        __gb_write(gb, gb->cpu_reg.hl, imm);
         goto exit;
     }
 
     _0x37: { /* SCF */
+        __GB_FLAGS(gb);
         gb->cpu_reg.f_bits.n = 0;
         gb->cpu_reg.f_bits.h = 0;
         gb->cpu_reg.f_bits.c = 1;
@@ -2021,23 +3981,28 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0x38: { /* JP C, imm */
+        __GB_FLAGS(gb);
         if(gb->cpu_reg.f_bits.c)
         {
-            int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc++);
-            gb->cpu_reg.pc += temp;
+            int8_t temp = (int8_t) imm;
             inst_cycles += 4;
+
+            if(temp < 0 && gb->direct.idle_skip)
+                __gb_skip_idle_loop(gb, pc + temp,
+                        pc - 2, sp, inst_cycles, op_cycles);
+
+            pc += temp;
         }
-        else
-            gb->cpu_reg.pc++;
 
         goto exit;
     }
 
     _0x39: { /* ADD HL, SP */
-        uint_fast32_t temp = gb->cpu_reg.hl + gb->cpu_reg.sp;
+        __GB_FLAGS(gb);
+        uint_fast32_t temp = gb->cpu_reg.hl + sp;
         gb->cpu_reg.f_bits.n = 0;
         gb->cpu_reg.f_bits.h =
-            ((gb->cpu_reg.hl & 0xFFF) + (gb->cpu_reg.sp & 0xFFF)) & 0x1000 ? 1 : 0;
+            ((gb->cpu_reg.hl & 0xFFF) + (sp & 0xFFF)) & 0x1000 ? 1 : 0;
         gb->cpu_reg.f_bits.c = temp & 0x10000 ? 1 : 0;
         gb->cpu_reg.hl = (uint16_t)temp;
         goto exit;
@@ -2049,32 +4014,29 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0x3B: { /* DEC SP */
-        gb->cpu_reg.sp--;
+        sp--;
         goto exit;
     }
 
     _0x3C: { /* INC A */
         gb->cpu_reg.a++;
-        gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h = ((gb->cpu_reg.a & 0x0F) == 0x00);
+        __GB_INC_FLAGS(gb, gb->cpu_reg.a);
         goto exit;
     }
 
     _0x3D: { /* DEC A */
         gb->cpu_reg.a--;
-        gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h = ((gb->cpu_reg.a & 0x0F) == 0x0F);
+        __GB_DEC_FLAGS(gb, gb->cpu_reg.a);
         goto exit;
     }
 
     _0x3E: { /* LD A, imm */
-        gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.pc++);
+        gb->cpu_reg.a = imm;
         goto exit;
     }
 
     _0x3F: { /* CCF */
+        __GB_FLAGS(gb);
         gb->cpu_reg.f_bits.n = 0;
         gb->cpu_reg.f_bits.h = 0;
         gb->cpu_reg.f_bits.c = ~gb->cpu_reg.f_bits.c;
@@ -2397,244 +4359,156 @@ void __gb_step_cpu(struct gb_s *gb)
 
     _0x80: { /* ADD A, B */
         uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.b;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.b ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_ADD_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.b, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x81: { /* ADD A, C */
         uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.c;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.c ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_ADD_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.c, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x82: { /* ADD A, D */
         uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.d;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.d ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_ADD_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.d, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x83: { /* ADD A, E */
         uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.e;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.e ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_ADD_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.e, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x84: { /* ADD A, H */
         uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.h;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.h ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_ADD_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.h, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x85: { /* ADD A, L */
         uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.l;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.l ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_ADD_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.l, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x86: { /* ADD A, (HL) */
-        uint8_t hl = __gb_read(gb, gb->cpu_reg.hl);
-        uint16_t temp = gb->cpu_reg.a + hl;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ hl ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        uint8_t val = __gb_read(gb, gb->cpu_reg.hl);
+        uint16_t temp = gb->cpu_reg.a + val;
+        __GB_ADD_FLAGS(gb, gb->cpu_reg.a, val, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x87: { /* ADD A, A */
         uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.a;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h = temp & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_ADD_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.a, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x88: { /* ADC A, B */
-        uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.b + gb->cpu_reg.f_bits.c;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.b ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.b + __GB_CARRY(gb);
+        __GB_ADD_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.b, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x89: { /* ADC A, C */
-        uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.c + gb->cpu_reg.f_bits.c;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.c ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.c + __GB_CARRY(gb);
+        __GB_ADD_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.c, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x8A: { /* ADC A, D */
-        uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.d + gb->cpu_reg.f_bits.c;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.d ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.d + __GB_CARRY(gb);
+        __GB_ADD_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.d, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x8B: { /* ADC A, E */
-        uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.e + gb->cpu_reg.f_bits.c;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.e ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.e + __GB_CARRY(gb);
+        __GB_ADD_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.e, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x8C: { /* ADC A, H */
-        uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.h + gb->cpu_reg.f_bits.c;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.h ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.h + __GB_CARRY(gb);
+        __GB_ADD_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.h, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x8D: { /* ADC A, L */
-        uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.l + gb->cpu_reg.f_bits.c;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.l ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.l + __GB_CARRY(gb);
+        __GB_ADD_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.l, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x8E: { /* ADC A, (HL) */
         uint8_t val = __gb_read(gb, gb->cpu_reg.hl);
-        uint16_t temp = gb->cpu_reg.a + val + gb->cpu_reg.f_bits.c;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ val ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        uint16_t temp = gb->cpu_reg.a + val + __GB_CARRY(gb);
+        __GB_ADD_FLAGS(gb, gb->cpu_reg.a, val, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x8F: { /* ADC A, A */
-        uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.a + gb->cpu_reg.f_bits.c;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 0;
-        /* TODO: Optimisation here? */
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.a ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        uint16_t temp = gb->cpu_reg.a + gb->cpu_reg.a + __GB_CARRY(gb);
+        __GB_ADD_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.a, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x90: { /* SUB B */
         uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.b;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.b ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.b, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x91: { /* SUB C */
         uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.c;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.c ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.c, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x92: { /* SUB D */
         uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.d;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.d ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.d, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x93: { /* SUB E */
         uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.e;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.e ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.e, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x94: { /* SUB H */
         uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.h;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.h ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.h, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x95: { /* SUB L */
         uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.l;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.l ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.l, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
@@ -2642,16 +4516,13 @@ void __gb_step_cpu(struct gb_s *gb)
     _0x96: { /* SUB (HL) */
         uint8_t val = __gb_read(gb, gb->cpu_reg.hl);
         uint16_t temp = gb->cpu_reg.a - val;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ val ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, val, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x97: { /* SUB A */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = 0;
         gb->cpu_reg.f_bits.z = 1;
         gb->cpu_reg.f_bits.n = 1;
@@ -2661,92 +4532,66 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0x98: { /* SBC A, B */
-        uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.b - gb->cpu_reg.f_bits.c;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.b ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.b - __GB_CARRY(gb);
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.b, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x99: { /* SBC A, C */
-        uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.c - gb->cpu_reg.f_bits.c;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.c ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.c - __GB_CARRY(gb);
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.c, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x9A: { /* SBC A, D */
-        uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.d - gb->cpu_reg.f_bits.c;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.d ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.d - __GB_CARRY(gb);
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.d, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x9B: { /* SBC A, E */
-        uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.e - gb->cpu_reg.f_bits.c;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.e ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.e - __GB_CARRY(gb);
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.e, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x9C: { /* SBC A, H */
-        uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.h - gb->cpu_reg.f_bits.c;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.h ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.h - __GB_CARRY(gb);
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.h, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x9D: { /* SBC A, L */
-        uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.l - gb->cpu_reg.f_bits.c;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.l ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.l - __GB_CARRY(gb);
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.l, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x9E: { /* SBC A, (HL) */
         uint8_t val = __gb_read(gb, gb->cpu_reg.hl);
-        uint16_t temp = gb->cpu_reg.a - val - gb->cpu_reg.f_bits.c;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ val ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        uint16_t temp = gb->cpu_reg.a - val - __GB_CARRY(gb);
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, val, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0x9F: { /* SBC A, A */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.f_bits.c ? 0xFF : 0x00;
         gb->cpu_reg.f_bits.z = !gb->cpu_reg.f_bits.c;
         gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h = gb->cpu_reg.f_bits.c;
+        gb->cpu_reg.f_bits.h = __GB_CARRY(gb);
         goto exit;
     }
 
     _0xA0: { /* AND B */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a & gb->cpu_reg.b;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2756,6 +4601,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xA1: { /* AND C */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a & gb->cpu_reg.c;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2765,6 +4611,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xA2: { /* AND D */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a & gb->cpu_reg.d;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2774,6 +4621,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xA3: { /* AND E */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a & gb->cpu_reg.e;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2783,6 +4631,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xA4: { /* AND H */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a & gb->cpu_reg.h;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2792,6 +4641,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xA5: { /* AND L */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a & gb->cpu_reg.l;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2801,6 +4651,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xA6: { /* AND B */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a & __gb_read(gb, gb->cpu_reg.hl);
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2810,6 +4661,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xA7: { /* AND A */
+        __GB_FLAGS(gb);
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
         gb->cpu_reg.f_bits.h = 1;
@@ -2818,6 +4670,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xA8: { /* XOR B */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a ^ gb->cpu_reg.b;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2827,6 +4680,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xA9: { /* XOR C */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a ^ gb->cpu_reg.c;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2836,6 +4690,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xAA: { /* XOR D */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a ^ gb->cpu_reg.d;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2845,6 +4700,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xAB: { /* XOR E */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a ^ gb->cpu_reg.e;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2854,6 +4710,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xAC: { /* XOR H */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a ^ gb->cpu_reg.h;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2863,6 +4720,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xAD: { /* XOR L */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a ^ gb->cpu_reg.l;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2872,6 +4730,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xAE: { /* XOR (HL) */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a ^ __gb_read(gb, gb->cpu_reg.hl);
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2881,6 +4740,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xAF: { /* XOR A */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = 0x00;
         gb->cpu_reg.f_bits.z = 1;
         gb->cpu_reg.f_bits.n = 0;
@@ -2890,6 +4750,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xB0: { /* OR B */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a | gb->cpu_reg.b;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2899,6 +4760,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xB1: { /* OR C */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a | gb->cpu_reg.c;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2908,6 +4770,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xB2: { /* OR D */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a | gb->cpu_reg.d;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2917,6 +4780,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xB3: { /* OR E */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a | gb->cpu_reg.e;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2926,6 +4790,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xB4: { /* OR H */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a | gb->cpu_reg.h;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2935,6 +4800,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xB5: { /* OR L */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a | gb->cpu_reg.l;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2944,6 +4810,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xB6: { /* OR (HL) */
+        __GB_FLAGS(gb);
         gb->cpu_reg.a = gb->cpu_reg.a | __gb_read(gb, gb->cpu_reg.hl);
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
@@ -2953,6 +4820,7 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xB7: { /* OR A */
+        __GB_FLAGS(gb);
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
         gb->cpu_reg.f_bits.h = 0;
@@ -2962,61 +4830,37 @@ void __gb_step_cpu(struct gb_s *gb)
 
     _0xB8: { /* CP B */
         uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.b;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.b ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.b, temp);
         goto exit;
     }
 
     _0xB9: { /* CP C */
         uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.c;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.c ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.c, temp);
         goto exit;
     }
 
     _0xBA: { /* CP D */
         uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.d;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.d ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.d, temp);
         goto exit;
     }
 
     _0xBB: { /* CP E */
         uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.e;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.e ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.e, temp);
         goto exit;
     }
 
     _0xBC: { /* CP H */
         uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.h;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.h ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.h, temp);
         goto exit;
     }
 
     _0xBD: { /* CP L */
         uint16_t temp = gb->cpu_reg.a - gb->cpu_reg.l;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ gb->cpu_reg.l ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, gb->cpu_reg.l, temp);
         goto exit;
     }
 
@@ -3024,15 +4868,12 @@ void __gb_step_cpu(struct gb_s *gb)
     _0xBE: { /* CP B */
         uint8_t val = __gb_read(gb, gb->cpu_reg.hl);
         uint16_t temp = gb->cpu_reg.a - val;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ val ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, val, temp);
         goto exit;
     }
 
     _0xBF: { /* CP A */
+        __GB_FLAGS(gb);
         gb->cpu_reg.f_bits.z = 1;
         gb->cpu_reg.f_bits.n = 1;
         gb->cpu_reg.f_bits.h = 0;
@@ -3041,10 +4882,11 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xC0: { /* RET NZ */
+        __GB_FLAGS(gb);
         if(!gb->cpu_reg.f_bits.z)
         {
-            gb->cpu_reg.pc = __gb_read(gb, gb->cpu_reg.sp++);
-            gb->cpu_reg.pc |= __gb_read(gb, gb->cpu_reg.sp++) << 8;
+            pc = __gb_read(gb, sp++);
+            pc |= __gb_read(gb, sp++) << 8;
             inst_cycles += 12;
         }
 
@@ -3052,80 +4894,81 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xC1: { /* POP BC */
-        gb->cpu_reg.c = __gb_read(gb, gb->cpu_reg.sp++);
-        gb->cpu_reg.b = __gb_read(gb, gb->cpu_reg.sp++);
+        gb->cpu_reg.c = __gb_read(gb, sp++);
+        gb->cpu_reg.b = __gb_read(gb, sp++);
         goto exit;
     }
 
     _0xC2: { /* JP NZ, imm */
+        __GB_FLAGS(gb);
         if(!gb->cpu_reg.f_bits.z)
         {
-            uint16_t temp = __gb_read(gb, gb->cpu_reg.pc++);
-            temp |= __gb_read(gb, gb->cpu_reg.pc++) << 8;
-            gb->cpu_reg.pc = temp;
+            uint16_t temp = imm;
             inst_cycles += 4;
+
+            if(temp < pc && gb->direct.idle_skip)
+                __gb_skip_idle_loop(gb, temp, pc - 3,
+                        sp, inst_cycles, op_cycles);
+
+            pc = temp;
         }
-        else
-            gb->cpu_reg.pc += 2;
 
         goto exit;
     }
 
     _0xC3: { /* JP imm */
-        uint16_t temp = __gb_read(gb, gb->cpu_reg.pc++);
-        temp |= __gb_read(gb, gb->cpu_reg.pc) << 8;
-        gb->cpu_reg.pc = temp;
+        uint16_t temp = imm;
+
+        if(temp < pc && gb->direct.idle_skip)
+            __gb_skip_idle_loop(gb, temp, pc - 3,
+                    sp, inst_cycles, op_cycles);
+
+        pc = temp;
         goto exit;
     }
 
     _0xC4: { /* CALL NZ imm */
+        __GB_FLAGS(gb);
         if(!gb->cpu_reg.f_bits.z)
         {
-            uint16_t temp = __gb_read(gb, gb->cpu_reg.pc++);
-            temp |= __gb_read(gb, gb->cpu_reg.pc++) << 8;
-            __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc >> 8);
-            __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc & 0xFF);
-            gb->cpu_reg.pc = temp;
+            uint16_t temp = imm;
+            __gb_write(gb, --sp, pc >> 8);
+            __gb_write(gb, --sp, pc & 0xFF);
+            pc = temp;
             inst_cycles += 12;
         }
-        else
-            gb->cpu_reg.pc += 2;
 
         goto exit;
     }
 
     _0xC5: { /* PUSH BC */
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.b);
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.c);
+        __gb_write(gb, --sp, gb->cpu_reg.b);
+        __gb_write(gb, --sp, gb->cpu_reg.c);
         goto exit;
     }
 
     _0xC6: { /* ADD A, imm */
-        /* Taken from SameBoy, which is released under MIT Licence. */
-        uint8_t value = __gb_read(gb, gb->cpu_reg.pc++);
-        uint16_t calc = gb->cpu_reg.a + value;
-        gb->cpu_reg.f_bits.z = ((uint8_t)calc == 0) ? 1 : 0;
-        gb->cpu_reg.f_bits.h =
-            ((gb->cpu_reg.a & 0xF) + (value & 0xF) > 0x0F) ? 1 : 0;
-        gb->cpu_reg.f_bits.c = calc > 0xFF ? 1 : 0;
-        gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.a = (uint8_t)calc;
+        uint8_t val = imm;
+        uint16_t temp = gb->cpu_reg.a + val;
+        __GB_ADD_FLAGS(gb, gb->cpu_reg.a, val, temp);
+        gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0xC7: { /* RST 0x0000 */
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc >> 8);
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc & 0xFF);
-        gb->cpu_reg.pc = 0x0000;
+        __gb_write(gb, --sp, pc >> 8);
+        __gb_write(gb, --sp, pc & 0xFF);
+        pc = 0x0000;
         goto exit;
     }
 
     _0xC8: { /* RET Z */
+        __GB_FLAGS(gb);
         if(gb->cpu_reg.f_bits.z)
         {
-            uint16_t temp = __gb_read(gb, gb->cpu_reg.sp++);
-            temp |= __gb_read(gb, gb->cpu_reg.sp++) << 8;
-            gb->cpu_reg.pc = temp;
+            uint16_t temp = __gb_read(gb, sp++);
+            temp |= __gb_read(gb, sp++) << 8;
+            pc = temp;
             inst_cycles += 12;
         }
 
@@ -3133,85 +4976,83 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xC9: { /* RET */
-        uint16_t temp = __gb_read(gb, gb->cpu_reg.sp++);
-        temp |= __gb_read(gb, gb->cpu_reg.sp++) << 8;
-        gb->cpu_reg.pc = temp;
+        uint16_t temp = __gb_read(gb, sp++);
+        temp |= __gb_read(gb, sp++) << 8;
+        pc = temp;
         goto exit;
     }
 
     _0xCA: { /* JP Z, imm */
+        __GB_FLAGS(gb);
         if(gb->cpu_reg.f_bits.z)
         {
-            uint16_t temp = __gb_read(gb, gb->cpu_reg.pc++);
-            temp |= __gb_read(gb, gb->cpu_reg.pc++) << 8;
-            gb->cpu_reg.pc = temp;
+            uint16_t temp = imm;
             inst_cycles += 4;
+
+            if(temp < pc && gb->direct.idle_skip)
+                __gb_skip_idle_loop(gb, temp, pc - 3,
+                        sp, inst_cycles, op_cycles);
+
+            pc = temp;
         }
-        else
-            gb->cpu_reg.pc += 2;
 
         goto exit;
     }
 
     _0xCB: { /* CB INST */
-        inst_cycles = __gb_execute_cb(gb);
+        __GB_FLAGS(gb);
+        inst_cycles = __gb_execute_cb(gb, imm);
+#if PEANUT_GB_PROFILE
+        if(gb->profile != NULL)
+            gb->profile->cb_count[imm & 0xFF]++;
+#endif
         goto exit;
     }
 
     _0xCC: { /* CALL Z, imm */
+        __GB_FLAGS(gb);
         if(gb->cpu_reg.f_bits.z)
         {
-            uint16_t temp = __gb_read(gb, gb->cpu_reg.pc++);
-            temp |= __gb_read(gb, gb->cpu_reg.pc++) << 8;
-            __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc >> 8);
-            __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc & 0xFF);
-            gb->cpu_reg.pc = temp;
+            uint16_t temp = imm;
+            __gb_write(gb, --sp, pc >> 8);
+            __gb_write(gb, --sp, pc & 0xFF);
+            pc = temp;
             inst_cycles += 12;
         }
-        else
-            gb->cpu_reg.pc += 2;
 
         goto exit;
     }
 
     _0xCD: { /* CALL imm */
-        uint16_t addr = __gb_read(gb, gb->cpu_reg.pc++);
-        addr |= __gb_read(gb, gb->cpu_reg.pc++) << 8;
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc >> 8);
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc & 0xFF);
-        gb->cpu_reg.pc = addr;
+        uint16_t addr = imm;
+        __gb_write(gb, --sp, pc >> 8);
+        __gb_write(gb, --sp, pc & 0xFF);
+        pc = addr;
         goto exit;
     }
 
     _0xCE: { /* ADC A, imm */
-        uint8_t value, a, carry;
-        value = __gb_read(gb, gb->cpu_reg.pc++);
-        a = gb->cpu_reg.a;
-        carry = gb->cpu_reg.f_bits.c;
-        gb->cpu_reg.a = a + value + carry;
-
-        gb->cpu_reg.f_bits.z = gb->cpu_reg.a == 0 ? 1 : 0;
-        gb->cpu_reg.f_bits.h =
-            ((a & 0xF) + (value & 0xF) + carry > 0x0F) ? 1 : 0;
-        gb->cpu_reg.f_bits.c =
-            (((uint16_t) a) + ((uint16_t) value) + carry > 0xFF) ? 1 : 0;
-        gb->cpu_reg.f_bits.n = 0;
+        uint8_t val = imm;
+        uint16_t temp = gb->cpu_reg.a + val + __GB_CARRY(gb);
+        __GB_ADD_FLAGS(gb, gb->cpu_reg.a, val, temp);
+        gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0xCF: { /* RST 0x0008 */
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc >> 8);
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc & 0xFF);
-        gb->cpu_reg.pc = 0x0008;
+        __gb_write(gb, --sp, pc >> 8);
+        __gb_write(gb, --sp, pc & 0xFF);
+        pc = 0x0008;
         goto exit;
     }
 
     _0xD0: { /* RET NC */
+        __GB_FLAGS(gb);
         if(!gb->cpu_reg.f_bits.c)
         {
-            uint16_t temp = __gb_read(gb, gb->cpu_reg.sp++);
-            temp |= __gb_read(gb, gb->cpu_reg.sp++) << 8;
-            gb->cpu_reg.pc = temp;
+            uint16_t temp = __gb_read(gb, sp++);
+            temp |= __gb_read(gb, sp++) << 8;
+            pc = temp;
             inst_cycles += 12;
         }
 
@@ -3219,72 +5060,70 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xD1: { /* POP DE */
-        gb->cpu_reg.e = __gb_read(gb, gb->cpu_reg.sp++);
-        gb->cpu_reg.d = __gb_read(gb, gb->cpu_reg.sp++);
+        gb->cpu_reg.e = __gb_read(gb, sp++);
+        gb->cpu_reg.d = __gb_read(gb, sp++);
         goto exit;
     }
 
     _0xD2: { /* JP NC, imm */
+        __GB_FLAGS(gb);
         if(!gb->cpu_reg.f_bits.c)
         {
-            uint16_t temp =  __gb_read(gb, gb->cpu_reg.pc++);
-            temp |=  __gb_read(gb, gb->cpu_reg.pc++) << 8;
-            gb->cpu_reg.pc = temp;
+            uint16_t temp = imm;
             inst_cycles += 4;
+
+            if(temp < pc && gb->direct.idle_skip)
+                __gb_skip_idle_loop(gb, temp, pc - 3,
+                        sp, inst_cycles, op_cycles);
+
+            pc = temp;
         }
-        else
-            gb->cpu_reg.pc += 2;
 
         goto exit;
     }
 
     _0xD4: { /* CALL NC, imm */
+        __GB_FLAGS(gb);
         if(!gb->cpu_reg.f_bits.c)
         {
-            uint16_t temp = __gb_read(gb, gb->cpu_reg.pc++);
-            temp |= __gb_read(gb, gb->cpu_reg.pc++) << 8;
-            __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc >> 8);
-            __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc & 0xFF);
-            gb->cpu_reg.pc = temp;
+            uint16_t temp = imm;
+            __gb_write(gb, --sp, pc >> 8);
+            __gb_write(gb, --sp, pc & 0xFF);
+            pc = temp;
             inst_cycles += 12;
         }
-        else
-            gb->cpu_reg.pc += 2;
 
         goto exit;
     }
 
     _0xD5: { /* PUSH DE */
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.d);
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.e);
+        __gb_write(gb, --sp, gb->cpu_reg.d);
+        __gb_write(gb, --sp, gb->cpu_reg.e);
         goto exit;
     }
 
     _0xD6: { /* SUB imm */
-        uint8_t val = __gb_read(gb, gb->cpu_reg.pc++);
+        uint8_t val = imm;
         uint16_t temp = gb->cpu_reg.a - val;
-        gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ val ^ temp) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, val, temp);
         gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0xD7: { /* RST 0x0010 */
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc >> 8);
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc & 0xFF);
-        gb->cpu_reg.pc = 0x0010;
+        __gb_write(gb, --sp, pc >> 8);
+        __gb_write(gb, --sp, pc & 0xFF);
+        pc = 0x0010;
         goto exit;
     }
 
     _0xD8: { /* RET C */
+        __GB_FLAGS(gb);
         if(gb->cpu_reg.f_bits.c)
         {
-            uint16_t temp = __gb_read(gb, gb->cpu_reg.sp++);
-            temp |= __gb_read(gb, gb->cpu_reg.sp++) << 8;
-            gb->cpu_reg.pc = temp;
+            uint16_t temp = __gb_read(gb, sp++);
+            temp |= __gb_read(gb, sp++) << 8;
+            pc = temp;
             inst_cycles += 12;
         }
 
@@ -3292,71 +5131,68 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xD9: { /* RETI */
-        uint16_t temp = __gb_read(gb, gb->cpu_reg.sp++);
-        temp |= __gb_read(gb, gb->cpu_reg.sp++) << 8;
-        gb->cpu_reg.pc = temp;
+        uint16_t temp = __gb_read(gb, sp++);
+        temp |= __gb_read(gb, sp++) << 8;
+        pc = temp;
         gb->gb_ime = 1;
         goto exit;
     }
 
     _0xDA: { /* JP C, imm */
+        __GB_FLAGS(gb);
         if(gb->cpu_reg.f_bits.c)
         {
-            uint16_t addr = __gb_read(gb, gb->cpu_reg.pc++);
-            addr |= __gb_read(gb, gb->cpu_reg.pc++) << 8;
-            gb->cpu_reg.pc = addr;
+            uint16_t addr = imm;
             inst_cycles += 4;
+
+            if(addr < pc && gb->direct.idle_skip)
+                __gb_skip_idle_loop(gb, addr, pc - 3,
+                        sp, inst_cycles, op_cycles);
+
+            pc = addr;
         }
-        else
-            gb->cpu_reg.pc += 2;
 
         goto exit;
     }
 
     _0xDC: { /* CALL C, imm */
+        __GB_FLAGS(gb);
         if(gb->cpu_reg.f_bits.c)
         {
-            uint16_t temp = __gb_read(gb, gb->cpu_reg.pc++);
-            temp |= __gb_read(gb, gb->cpu_reg.pc++) << 8;
-            __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc >> 8);
-            __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc & 0xFF);
-            gb->cpu_reg.pc = temp;
+            uint16_t temp = imm;
+            __gb_write(gb, --sp, pc >> 8);
+            __gb_write(gb, --sp, pc & 0xFF);
+            pc = temp;
             inst_cycles += 12;
         }
-        else
-            gb->cpu_reg.pc += 2;
 
         goto exit;
     }
 
     _0xDE: { /* SBC A, imm */
-        uint8_t temp_8 = __gb_read(gb, gb->cpu_reg.pc++);
-        uint16_t temp_16 = gb->cpu_reg.a - temp_8 - gb->cpu_reg.f_bits.c;
-        gb->cpu_reg.f_bits.z = ((temp_16 & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h =
-            (gb->cpu_reg.a ^ temp_8 ^ temp_16) & 0x10 ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp_16 & 0xFF00) ? 1 : 0;
-        gb->cpu_reg.a = (temp_16 & 0xFF);
+        uint8_t val = imm;
+        uint16_t temp = gb->cpu_reg.a - val - __GB_CARRY(gb);
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, val, temp);
+        gb->cpu_reg.a = (temp & 0xFF);
         goto exit;
     }
 
     _0xDF: { /* RST 0x0018 */
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc >> 8);
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc & 0xFF);
-        gb->cpu_reg.pc = 0x0018;
+        __gb_write(gb, --sp, pc >> 8);
+        __gb_write(gb, --sp, pc & 0xFF);
+        pc = 0x0018;
         goto exit;
     }
 
     _0xE0: { /* LD (0xFF00+imm), A */
-        __gb_write(gb, 0xFF00 | __gb_read(gb, gb->cpu_reg.pc++),
+        __gb_write(gb, 0xFF00 | imm,
                 gb->cpu_reg.a);
         goto exit;
     }
 
     _0xE1: { /* POP HL */
-        gb->cpu_reg.l = __gb_read(gb, gb->cpu_reg.sp++);
-        gb->cpu_reg.h = __gb_read(gb, gb->cpu_reg.sp++);
+        gb->cpu_reg.l = __gb_read(gb, sp++);
+        gb->cpu_reg.h = __gb_read(gb, sp++);
         goto exit;
     }
 
@@ -3366,14 +5202,15 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xE5: { /* PUSH HL */
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.h);
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.l);
+        __gb_write(gb, --sp, gb->cpu_reg.h);
+        __gb_write(gb, --sp, gb->cpu_reg.l);
         goto exit;
     }
 
     _0xE6: { /* AND imm */
+        __GB_FLAGS(gb);
         /* TODO: Optimisation? */
-        gb->cpu_reg.a = gb->cpu_reg.a & __gb_read(gb, gb->cpu_reg.pc++);
+        gb->cpu_reg.a = gb->cpu_reg.a & imm;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
         gb->cpu_reg.f_bits.h = 1;
@@ -3382,37 +5219,38 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xE7: { /* RST 0x0020 */
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc >> 8);
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc & 0xFF);
-        gb->cpu_reg.pc = 0x0020;
+        __gb_write(gb, --sp, pc >> 8);
+        __gb_write(gb, --sp, pc & 0xFF);
+        pc = 0x0020;
         goto exit;
     }
 
     _0xE8: { /* ADD SP, imm */
-        int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc++);
+        __GB_FLAGS(gb);
+        int8_t offset = (int8_t) imm;
         /* TODO: Move flag assignments for optimisation. */
         gb->cpu_reg.f_bits.z = 0;
         gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h = ((gb->cpu_reg.sp & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
-        gb->cpu_reg.f_bits.c = ((gb->cpu_reg.sp & 0xFF) + (offset & 0xFF) > 0xFF);
-        gb->cpu_reg.sp += offset;
+        gb->cpu_reg.f_bits.h = ((sp & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
+        gb->cpu_reg.f_bits.c = ((sp & 0xFF) + (offset & 0xFF) > 0xFF);
+        sp += offset;
         goto exit;
     }
 
     _0xE9: { /* JP (HL) */
-        gb->cpu_reg.pc = gb->cpu_reg.hl;
+        pc = gb->cpu_reg.hl;
         goto exit;
     }
 
     _0xEA: { /* LD (imm), A */
-        uint16_t addr = __gb_read(gb, gb->cpu_reg.pc++);
-        addr |= __gb_read(gb, gb->cpu_reg.pc++) << 8;
+        uint16_t addr = imm;
         __gb_write(gb, addr, gb->cpu_reg.a);
         goto exit;
     }
 
     _0xEE: { /* XOR imm */
-        gb->cpu_reg.a = gb->cpu_reg.a ^ __gb_read(gb, gb->cpu_reg.pc++);
+        __GB_FLAGS(gb);
+        gb->cpu_reg.a = gb->cpu_reg.a ^ imm;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
         gb->cpu_reg.f_bits.h = 0;
@@ -3421,25 +5259,26 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xEF: { /* RST 0x0028 */
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc >> 8);
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc & 0xFF);
-        gb->cpu_reg.pc = 0x0028;
+        __gb_write(gb, --sp, pc >> 8);
+        __gb_write(gb, --sp, pc & 0xFF);
+        pc = 0x0028;
         goto exit;
     }
 
     _0xF0: { /* LD A, (0xFF00+imm) */
         gb->cpu_reg.a =
-            __gb_read(gb, 0xFF00 | __gb_read(gb, gb->cpu_reg.pc++));
+            __gb_read(gb, 0xFF00 | imm);
         goto exit;
     }
 
     _0xF1: { /* POP AF */
-        uint8_t temp_8 = __gb_read(gb, gb->cpu_reg.sp++);
+        __GB_FLAGS(gb);
+        uint8_t temp_8 = __gb_read(gb, sp++);
         gb->cpu_reg.f_bits.z = (temp_8 >> 7) & 1;
         gb->cpu_reg.f_bits.n = (temp_8 >> 6) & 1;
         gb->cpu_reg.f_bits.h = (temp_8 >> 5) & 1;
         gb->cpu_reg.f_bits.c = (temp_8 >> 4) & 1;
-        gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.sp++);
+        gb->cpu_reg.a = __gb_read(gb, sp++);
         goto exit;
     }
 
@@ -3454,15 +5293,17 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xF5: { /* PUSH AF */
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.a);
-        __gb_write(gb, --gb->cpu_reg.sp,
+        __GB_FLAGS(gb);
+        __gb_write(gb, --sp, gb->cpu_reg.a);
+        __gb_write(gb, --sp,
                 gb->cpu_reg.f_bits.z << 7 | gb->cpu_reg.f_bits.n << 6 |
                 gb->cpu_reg.f_bits.h << 5 | gb->cpu_reg.f_bits.c << 4);
         goto exit;
     }
 
     _0xF6: { /* OR imm */
-        gb->cpu_reg.a = gb->cpu_reg.a | __gb_read(gb, gb->cpu_reg.pc++);
+        __GB_FLAGS(gb);
+        gb->cpu_reg.a = gb->cpu_reg.a | imm;
         gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
         gb->cpu_reg.f_bits.n = 0;
         gb->cpu_reg.f_bits.h = 0;
@@ -3471,32 +5312,32 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xF7: { /* PUSH AF */
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc >> 8);
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc & 0xFF);
-        gb->cpu_reg.pc = 0x0030;
+        __gb_write(gb, --sp, pc >> 8);
+        __gb_write(gb, --sp, pc & 0xFF);
+        pc = 0x0030;
         goto exit;
     }
 
     _0xF8: { /* LD HL, SP+/-imm */
+        __GB_FLAGS(gb);
         /* Taken from SameBoy, which is released under MIT Licence. */
-        int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc++);
-        gb->cpu_reg.hl = gb->cpu_reg.sp + offset;
+        int8_t offset = (int8_t) imm;
+        gb->cpu_reg.hl = sp + offset;
         gb->cpu_reg.f_bits.z = 0;
         gb->cpu_reg.f_bits.n = 0;
-        gb->cpu_reg.f_bits.h = ((gb->cpu_reg.sp & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
-        gb->cpu_reg.f_bits.c = ((gb->cpu_reg.sp & 0xFF) + (offset & 0xFF) > 0xFF) ? 1 :
+        gb->cpu_reg.f_bits.h = ((sp & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
+        gb->cpu_reg.f_bits.c = ((sp & 0xFF) + (offset & 0xFF) > 0xFF) ? 1 :
                         0;
         goto exit;
     }
 
     _0xF9: { /* LD SP, HL */
-        gb->cpu_reg.sp = gb->cpu_reg.hl;
+        sp = gb->cpu_reg.hl;
         goto exit;
     }
 
     _0xFA: { /* LD A, (imm) */
-        uint16_t addr = __gb_read(gb, gb->cpu_reg.pc++);
-        addr |= __gb_read(gb, gb->cpu_reg.pc++) << 8;
+        uint16_t addr = imm;
         gb->cpu_reg.a = __gb_read(gb, addr);
         goto exit;
     }
@@ -3507,212 +5348,79 @@ void __gb_step_cpu(struct gb_s *gb)
     }
 
     _0xFE: { /* CP imm */
-        uint8_t temp_8 = __gb_read(gb, gb->cpu_reg.pc++);
-        uint16_t temp_16 = gb->cpu_reg.a - temp_8;
-        gb->cpu_reg.f_bits.z = ((temp_16 & 0xFF) == 0x00);
-        gb->cpu_reg.f_bits.n = 1;
-        gb->cpu_reg.f_bits.h = ((gb->cpu_reg.a ^ temp_8 ^ temp_16) & 0x10) ? 1 : 0;
-        gb->cpu_reg.f_bits.c = (temp_16 & 0xFF00) ? 1 : 0;
+        uint8_t val = imm;
+        uint16_t temp = gb->cpu_reg.a - val;
+        __GB_SUB_FLAGS(gb, gb->cpu_reg.a, val, temp);
         goto exit;
     }
 
     _0xFF: { /* RST 0x0038 */
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc >> 8);
-        __gb_write(gb, --gb->cpu_reg.sp, gb->cpu_reg.pc & 0xFF);
-        gb->cpu_reg.pc = 0x0038;
+        __gb_write(gb, --sp, pc >> 8);
+        __gb_write(gb, --sp, pc & 0xFF);
+        pc = 0x0038;
         goto exit;
     }
 
     _invalid: {
+        /* The error handler may inspect or reset the CPU. */
+        gb->cpu_reg.pc = pc;
+        gb->cpu_reg.sp = sp;
         (gb->gb_error)(gb, GB_INVALID_OPCODE, opcode);
+        pc = gb->cpu_reg.pc;
+        sp = gb->cpu_reg.sp;
         // Early exit
         gb->gb_frame = 1;
     }
 
     exit: {
-    
-        /* DIV register timing */
-        gb->counter.div_count += inst_cycles;
-        
-        if(gb->counter.div_count >= DIV_CYCLES)
-        {
-            gb->gb_reg.DIV++;
-            gb->counter.div_count -= DIV_CYCLES;
-        }
-        
-        /* Check serial transmission. */
-        if(gb->gb_reg.SC & SERIAL_SC_TX_START)
-        {
-            /* If new transfer, call TX function. */
-            if(gb->counter.serial_count == 0 && gb->gb_serial_tx != NULL)
-                (gb->gb_serial_tx)(gb, gb->gb_reg.SB);
-            
-            gb->counter.serial_count += inst_cycles;
-            
-            /* If it's time to receive byte, call RX function. */
-            if(gb->counter.serial_count >= SERIAL_CYCLES)
-            {
-                /* If RX can be done, do it. */
-                /* If RX failed, do not change SB if using external
-                 * clock, or set to 0xFF if using internal clock. */
-                uint8_t rx;
-                
-                if(gb->gb_serial_rx != NULL &&
-                   (gb->gb_serial_rx(gb, &rx) ==
-                    GB_SERIAL_RX_SUCCESS))
-                {
-                    gb->gb_reg.SB = rx;
-                    
-                    /* Inform game of serial TX/RX completion. */
-                    gb->gb_reg.SC &= 0x01;
-                    gb->gb_reg.IF |= SERIAL_INTR;
-                }
-                else if(gb->gb_reg.SC & SERIAL_SC_CLOCK_SRC)
-                {
-                    /* If using internal clock, and console is not
-                     * attached to any external peripheral, shifted
-                     * bits are replaced with logic 1. */
-                    gb->gb_reg.SB = 0xFF;
-                    
-                    /* Inform game of serial TX/RX completion. */
-                    gb->gb_reg.SC &= 0x01;
-                    gb->gb_reg.IF |= SERIAL_INTR;
-                }
-                else
-                {
-                    /* If using external clock, and console is not
-                     * attached to any external peripheral, bits are
-                     * not shifted, so SB is not modified. */
-                }
-                
-                gb->counter.serial_count = 0;
-            }
-        }
-                
-        /* TIMA register timing */
-        /* TODO: Change tac_enable to struct of TAC timer control bits. */
-        if(gb->gb_reg.tac_enable)
-        {
-            static const uint_fast16_t TAC_CYCLES[4] = {1024, 16, 64, 256};
-            
-            gb->counter.tima_count += inst_cycles;
-            
-            uint_fast16_t tac_cycle = TAC_CYCLES[gb->gb_reg.tac_rate];
-            
-            while(gb->counter.tima_count >= tac_cycle)
-            {
-                gb->counter.tima_count -= tac_cycle;
-                
-                if(++gb->gb_reg.TIMA == 0)
-                {
-                    gb->gb_reg.IF |= TIMER_INTR;
-                    /* On overflow, set TMA to TIMA. */
-                    gb->gb_reg.TIMA = gb->gb_reg.TMA;
-                }
-            }
-        }
-        
-        /* TODO Check behaviour of LCD during LCD power off state. */
-        /* If LCD is off, don't update LCD state. */
-        if((gb->gb_reg.LCDC & LCDC_ENABLE) == 0)
-            return;
-        
-        /* LCD Timing */
-        gb->counter.lcd_count += inst_cycles;
-        
-        /* New Scanline */
-        if(gb->counter.lcd_count > LCD_LINE_CYCLES)
-        {
-            gb->counter.lcd_count -= LCD_LINE_CYCLES;
-            
-            /* LYC Update */
-            if(gb->gb_reg.LY == gb->gb_reg.LYC)
-            {
-                gb->gb_reg.STAT |= STAT_LYC_COINC;
-                
-                if(gb->gb_reg.STAT & STAT_LYC_INTR)
-                    gb->gb_reg.IF |= LCDC_INTR;
-            }
-            else
-                gb->gb_reg.STAT &= 0xFB;
-            
-            /* Next line */
-            uint16_t LY_1 = gb->gb_reg.LY + 1;
-            gb->gb_reg.LY = (LY_1 >= LCD_VERT_LINES) ? LY_1 - LCD_VERT_LINES : LY_1;
-            
-            /* VBLANK Start */
-            if(gb->gb_reg.LY == LCD_HEIGHT)
-            {
-                gb->lcd_mode = LCD_VBLANK;
-                gb->gb_frame = 1;
-                gb->gb_reg.IF |= VBLANK_INTR;
-                gb->lcd_blank = 0;
-                
-                if(gb->gb_reg.STAT & STAT_MODE_1_INTR)
-                    gb->gb_reg.IF |= LCDC_INTR;
-                
-    #if ENABLE_LCD
-                
-                /* If frame skip is activated, check if we need to draw
-                 * the frame or skip it. */
-                if(gb->direct.frame_skip)
-                {
-                    gb->display.frame_skip_count =
-                    !gb->display.frame_skip_count;
-                }
-                
-                if(!gb->direct.frame_skip ||
-                   !gb->display.frame_skip_count)
-                {
-                    gb->display.back_fb_enabled =
-                    !gb->display.back_fb_enabled;
-                }
-    #endif
-            }
-            /* Normal Line */
-            else if(gb->gb_reg.LY < LCD_HEIGHT)
-            {
-                if(gb->gb_reg.LY == 0)
-                {
-                    /* Clear Screen */
-                    gb->display.WY = gb->gb_reg.WY;
-                    gb->display.window_clear = 0;
-                }
-                
-                gb->lcd_mode = LCD_HBLANK;
-                
-                if(gb->gb_reg.STAT & STAT_MODE_0_INTR)
-                    gb->gb_reg.IF |= LCDC_INTR;
-            }
-        }
-        /* OAM access */
-        else if(gb->lcd_mode == LCD_HBLANK
-                && gb->counter.lcd_count >= LCD_MODE_2_CYCLES)
-        {
-            gb->lcd_mode = LCD_SEARCH_OAM;
-            
-            if(gb->gb_reg.STAT & STAT_MODE_2_INTR)
-                gb->gb_reg.IF |= LCDC_INTR;
-        }
-        /* Update LCD */
-        else if(gb->lcd_mode == LCD_SEARCH_OAM
-                && gb->counter.lcd_count >= LCD_MODE_3_CYCLES)
+        /* Timer, serial and LCD state is only brought up to date once
+         * the next event is due. */
+        gb->counter.pending_cycles += inst_cycles;
+#if PEANUT_GB_BENCHMARK
+        gb->counter.instructions++;
+#endif
+#if PEANUT_GB_PROFILE
+        if(gb->profile != NULL)
+            __gb_profile_op(gb, op_pc, opcode, inst_cycles);
+#endif
+
+        if(gb->counter.pending_cycles >= gb->counter.next_event)
         {
-            gb->lcd_mode = LCD_TRANSFER;
-    #if ENABLE_LCD
-            if(!gb->lcd_blank && !(gb->direct.frame_skip && !gb->display.frame_skip_count))
-                __gb_draw_line(gb);
-    #endif
+            __gb_sync_counters(gb);
+            __gb_schedule_next_event(gb);
+            goto step_end;
         }
+
+#if PEANUT_GB_BLOCK_CACHE
+        if(op != NULL && ++op != op_end)
+            goto next_op;
+#endif
     }
+
+step_end:
+	if(!gb->gb_frame)
+		goto next_step;
+
+	gb->cpu_reg.pc = pc;
+	gb->cpu_reg.sp = sp;
 }
 
 void gb_run_frame(struct gb_s *gb)
 {
 	gb->gb_frame = 0;
-    
-	while(!gb->gb_frame)
-		__gb_step_cpu(gb);
+	__gb_run_cpu(gb);
+
+	/* Leave F up to date for the front-end. */
+	__GB_FLAGS(gb);
+}
+
+/**
+ * Gets the clock that the writes to the audio registers are timestamped with,
+ * in cycles since the last reset.
+ */
+uint32_t gb_get_clock(struct gb_s *gb)
+{
+	return gb->counter.clock + gb->counter.pending_cycles;
 }
 
 /**
@@ -3744,6 +5452,42 @@ void gb_init_serial(struct gb_s *gb,
 	gb->gb_serial_rx = gb_serial_rx;
 }
 
+#if PEANUT_GB_BLOCK_CACHE
+/**
+ * Attach a block cache, which speeds up execution by keeping decoded
+ * instructions. This is optional. The cache must remain allocated for as long
+ * as the context is used, and is shared by any copies of the context.
+ */
+void gb_init_block_cache(struct gb_s *gb, struct gb_block_cache_s *cache)
+{
+	gb->block_cache = cache;
+
+	if(cache != NULL)
+	{
+		cache->hits = 0;
+		cache->misses = 0;
+		cache->invalidations = 0;
+		__gb_flush_block_cache(gb);
+	}
+
+	__gb_update_memory_map(gb);
+}
+#endif
+
+#if PEANUT_GB_PROFILE
+/**
+ * Attach an execution profile, which is cleared and then filled in as the CPU
+ * runs. This is optional. Pass NULL to stop profiling.
+ */
+void gb_init_profile(struct gb_s *gb, struct gb_profile_s *profile)
+{
+	gb->profile = profile;
+
+	if(profile != NULL)
+		memset(profile, 0, sizeof(*profile));
+}
+#endif
+
 uint8_t gb_colour_hash(struct gb_s *gb)
 {
 #define ROM_TITLE_START_ADDR	0x0134
@@ -3772,6 +5516,11 @@ void gb_reset(struct gb_s *gb)
 	gb->cart_ram_bank = 0;
 	gb->enable_cart_ram = 0;
 	gb->cart_mode_select = 0;
+#if PEANUT_GB_BLOCK_CACHE
+	if(gb->block_cache != NULL)
+		__gb_flush_block_cache(gb);
+#endif
+	__gb_update_memory_map(gb);
 
 	/* Initialise CPU registers as though a DMG. */
 	gb->cpu_reg.af = 0x01B0;
@@ -3786,6 +5535,18 @@ void gb_reset(struct gb_s *gb)
 	gb->counter.div_count = 0;
 	gb->counter.tima_count = 0;
 	gb->counter.serial_count = 0;
+	gb->counter.pending_cycles = 0;
+	gb->counter.clock = 0;
+#if PEANUT_GB_BENCHMARK
+	gb->counter.instructions = 0;
+#endif
+
+	gb->idle.page = NULL;
+	gb->idle.cycles = 0;
+
+#if PEANUT_GB_LAZY_FLAGS
+	gb->lazy_flags.op = GB_LAZY_NONE;
+#endif
 
 	gb->gb_reg.TIMA      = 0x00;
 	gb->gb_reg.TMA       = 0x00;
@@ -3816,6 +5577,25 @@ void gb_reset(struct gb_s *gb)
 
 	memset(gb->vram, 0x00, VRAM_SIZE);
     memset(gb->wram, 0x00, WRAM_SIZE);
+#if ENABLE_LCD
+	memset(gb->display.tile_dirty, 0xFF, sizeof(gb->display.tile_dirty));
+	gb->display.sprites_dirty = 1;
+	gb->display.generation++;
+#if PEANUT_GB_PACKED_FB
+	gb->display.plane_select[0] = 0xFF;
+	gb->display.plane_select[1] = 0xFF;
+	gb->display.plane_tiles_dirty[0] = 0xFFFFFFFF;
+	gb->display.plane_tiles_dirty[1] = 0xFFFFFFFF;
+
+	for(uint_fast16_t y = 0; y < 256; y++)
+	{
+		gb->display.plane_version[0][y]++;
+		gb->display.plane_version[1][y]++;
+	}
+#endif
+#endif
+
+	__gb_schedule_next_event(gb);
 }
 
 /**
@@ -3870,6 +5650,13 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
 	gb->gb_serial_tx = NULL;
 	gb->gb_serial_rx = NULL;
 
+#if PEANUT_GB_BLOCK_CACHE
+	gb->block_cache = NULL;
+#endif
+#if PEANUT_GB_PROFILE
+	gb->profile = NULL;
+#endif
+
 	/* Check valid ROM using checksum value. */
 	{
 		uint8_t x = 0;
@@ -3890,6 +5677,29 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
 			return GB_INIT_CARTRIDGE_UNSUPPORTED;
 	}
 
+	switch(gb->mbc)
+	{
+	case 1:
+		gb->mbc_write = __gb_mbc1_write;
+		break;
+
+	case 2:
+		gb->mbc_write = __gb_mbc2_write;
+		break;
+
+	case 3:
+		gb->mbc_write = __gb_mbc3_write;
+		break;
+
+	case 5:
+		gb->mbc_write = __gb_mbc5_write;
+		break;
+
+	default:
+		gb->mbc_write = __gb_mbc0_write;
+		break;
+	}
+
 	gb->cart_ram = cart_ram[gb->gb_rom[mbc_location]];
 	gb->num_rom_banks_mask = num_rom_banks_mask[gb->gb_rom[bank_count_location]] - 1;
 	gb->num_ram_banks = num_ram_banks[gb->gb_rom[ram_size_location]];
@@ -3897,6 +5707,9 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
 	gb->lcd_blank = 0;
     
     gb->direct.sound = 0;
+	gb->direct.idle_skip = 0;
+	gb->idle.loops = 0;
+	gb->idle.skipped_cycles = 0;
     
 	gb_reset(gb);
 
@@ -3945,6 +5758,11 @@ void gb_init_lcd(struct gb_s *gb)
     
     memset(gb_front_fb, 0, sizeof(gb_front_fb));
     memset(gb_back_fb, 0, sizeof(gb_back_fb));
+    memset(gb->display.line_hash, 0, sizeof(gb->display.line_hash));
+    gb->display.sprites_dirty = 1;
+    memset(gb->direct.line_dirty, 0xFF, sizeof(gb->direct.line_dirty));
+    gb->display.frame_unchanged = 0;
+    gb->display.drawn_valid = 0;
         
 	gb->display.window_clear = 0;
 	gb->display.WY = 0;
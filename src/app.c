@@ -22,6 +22,7 @@ void PGB_init(void)
     
     playdate->file->mkdir("games");
     playdate->file->mkdir("saves");
+    playdate->file->mkdir("preferences");
     
     prefereces_init();
     
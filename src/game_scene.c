@@ -7,6 +7,23 @@
 
 #include "game_scene.h"
 #include "minigb_apu.h"
+
+// Lines are drawn with 2 bits per pixel and dithered straight to the screen
+#define PEANUT_GB_PACKED_FB 1
+
+// Seconds each Game Boy frame is shown
+#define PGB_FRAME_TIME (1.0f / 60)
+// Most frames skipped after each one drawn
+#define PGB_FRAME_SKIP_MAX 3
+
+#if PGB_DEBUG && PGB_DEBUG_BENCHMARK
+#define PEANUT_GB_BENCHMARK 1
+#endif
+
+#if PGB_DEBUG && PGB_DEBUG_PROFILE
+#define PEANUT_GB_PROFILE 1
+#endif
+
 #include "peanut_gb.h"
 #include "app.h"
 #include "library_scene.h"
@@ -21,15 +38,31 @@ typedef struct PGB_GameSceneContext {
     uint8_t vram[VRAM_SIZE];
     uint8_t *rom;
     uint8_t *cart_ram;
+#if PEANUT_GB_BLOCK_CACHE
+    struct gb_block_cache_s block_cache;
+#endif
+#if PEANUT_GB_PROFILE
+    struct gb_profile_s profile;
+#endif
 } PGB_GameSceneContext;
 
 static void PGB_GameScene_selector_init(PGB_GameScene *gameScene);
 static void PGB_GameScene_update(void *object);
 static void PGB_GameScene_menu(void *object);
 static void PGB_GameScene_saveGame(PGB_GameScene *gameScene);
-static void PGB_GameScene_generateBitmask(void);
+static void PGB_GameScene_updateFrameSkip(PGB_GameScene *gameScene, float cost, bool drawn);
 static void PGB_GameScene_free(void *object);
 
+#if PGB_DEBUG && PGB_DEBUG_BENCHMARK
+static void PGB_GameScene_opcodeBenchmark(void);
+static void PGB_GameScene_renderBenchmark(void);
+static void PGB_GameScene_wramCodeBenchmark(void);
+#endif
+
+#if PEANUT_GB_PROFILE
+static void PGB_GameScene_writeProfile(PGB_GameScene *gameScene);
+#endif
+
 static uint8_t *read_rom_to_ram(const char *filename, PGB_GameSceneError *sceneError);
 
 static void read_cart_ram_file(const char *save_filename, uint8_t **dest, const size_t len);
@@ -40,9 +73,6 @@ static void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16
 static const char *startButtonText = "start";
 static const char *selectButtonText = "select";
 
-static uint8_t PGB_bitmask[4][4][4];
-static bool PGB_GameScene_bitmask_done = false;
-
 PGB_GameScene* PGB_GameScene_new(const char *rom_filename)
 {
     PGB_Scene *scene = PGB_Scene_new();
@@ -78,8 +108,24 @@ PGB_GameScene* PGB_GameScene_new(const char *rom_filename)
     
     gameScene->audioEnabled = preferences_sound_enabled;
     gameScene->audioLocked = false;
-
-    PGB_GameScene_generateBitmask();
+    
+    prefereces_read_game(rom_filename, &gameScene->preferences);
+    PGB_Scaler_init(&gameScene->scaler, gameScene->preferences.scaler_mode);
+    gameScene->scalerMenuItem = NULL;
+    
+    gameScene->frameSkip = (PGB_FrameSkip){
+        .drawnCost = 0,
+        .skippedCost = 0,
+        .dirtyLines = 0,
+        .lag = 0,
+        .deferred = false
+    };
+    
+    #if PGB_DEBUG && PGB_DEBUG_BENCHMARK
+    PGB_GameScene_opcodeBenchmark();
+    PGB_GameScene_renderBenchmark();
+    PGB_GameScene_wramCodeBenchmark();
+    #endif
     
     PGB_GameScene_selector_init(gameScene);
     
@@ -88,6 +134,15 @@ PGB_GameScene* PGB_GameScene_new(const char *rom_filename)
     gameScene->debug_highlightFrame = PDRectMake(PGB_LCD_X - 1 - highlightWidth, 0, highlightWidth, playdate->display->getHeight());
     #endif
     
+    #if PGB_DEBUG && PGB_DEBUG_BENCHMARK
+    gameScene->debug_benchmarkTime = 0;
+    gameScene->debug_benchmarkFrames = 0;
+    #endif
+    
+    #if PGB_DEBUG && PGB_DEBUG_AUDIO
+    gameScene->debug_audioFrames = 0;
+    #endif
+    
     PGB_GameSceneContext *context = pgb_malloc(sizeof(PGB_GameSceneContext));
     context->scene = gameScene;
     context->rom = NULL;
@@ -105,6 +160,14 @@ PGB_GameScene* PGB_GameScene_new(const char *rom_filename)
         
         if(gb_ret == GB_INIT_NO_ERROR)
         {
+            #if PEANUT_GB_BLOCK_CACHE
+            gb_init_block_cache(&context->gb, &context->block_cache);
+            #endif
+            
+            #if PEANUT_GB_PROFILE
+            gb_init_profile(&context->gb, &context->profile);
+            #endif
+            
             char *save_filename = pgb_save_filename(rom_filename, false);
             gameScene->save_filename = save_filename;
             
@@ -132,7 +195,9 @@ PGB_GameScene* PGB_GameScene_new(const char *rom_filename)
             // init lcd
             gb_init_lcd(&context->gb);
             
-            context->gb.direct.frame_skip = preferences_frame_skip ? 1 : 0;
+            // Frame skip is chosen at every frame by PGB_GameScene_updateFrameSkip
+            context->gb.direct.frame_skip = 0;
+            context->gb.direct.idle_skip = 1;
 
             // set game state to loaded
             gameScene->state = PGB_GameSceneStateLoaded;
@@ -439,118 +504,133 @@ static void PGB_GameScene_update(void *object)
         memset(gameScene->debug_updatedRows, 0, LCD_ROWS);
         #endif
         
-        struct gb_s gb;
-        memcpy(&gb, &context->gb, sizeof(struct gb_s));
+        #if PGB_DEBUG && PGB_DEBUG_BENCHMARK
+        unsigned int benchmarkStart = playdate->system->getCurrentTimeMilliseconds();
+        #endif
         
-        gb_run_frame(&gb);
+        PGB_FrameSkip *frameSkip = &gameScene->frameSkip;
         
-        memcpy(&context->gb, &gb, sizeof(struct gb_s));
+        // Each frame has PGB_FRAME_TIME, and a late frame is made up by the next ones
+        frameSkip->lag = fmaxf(-PGB_FRAME_TIME, fminf(frameSkip->lag + PGB_App->dt - PGB_FRAME_TIME, PGB_FRAME_TIME * (PGB_FRAME_SKIP_MAX + 1)));
         
-        bool gb_draw = (!context->gb.direct.frame_skip || !context->gb.display.frame_skip_count || needsDisplay);
+        float frameStart = playdate->system->getElapsedTime();
         
-        gameScene->scene->preferredRefreshRate = gb_draw ? 60 : 0;
-        gameScene->scene->refreshRateCompensation = gb_draw ? (1.0f / 60 - PGB_App->dt) : 0;
+        gb_run_frame(&context->gb);
         
-        if(gb_draw)
+        #if AUDIO_RENDER_IN_FRAME
+        if(gameScene->audioEnabled)
         {
-            uint8_t *framebuffer = playdate->graphics->getFrame();
+            audio_frame(gb_get_clock(&context->gb));
             
-            int skip_counter = 0;
-            bool single_line = false;
+            #if PGB_DEBUG && PGB_DEBUG_AUDIO
+            if(++gameScene->debug_audioFrames == 300)
+            {
+                struct audio_stats stats;
+                audio_get_stats(&stats);
+                
+                playdate->system->logToConsole("Audio: %u samples buffered, rate %.2f%%, %u underruns, %u overruns", stats.level, (stats.ratio / 65536.0f - 1) * 100, stats.underruns, stats.overruns);
+                
+                gameScene->debug_audioFrames = 0;
+            }
+            #endif
+        }
+        #endif
+        
+        #if PGB_DEBUG && PGB_DEBUG_BENCHMARK
+        gameScene->debug_benchmarkTime += playdate->system->getCurrentTimeMilliseconds() - benchmarkStart;
+        gameScene->debug_benchmarkFrames++;
+        
+        if(gameScene->debug_benchmarkFrames == 300)
+        {
+            unsigned int time = pgb_max(gameScene->debug_benchmarkTime, 1);
             
-            int y2 = 0;
-            int lcd_rows = PGB_LCD_Y * LCD_ROWSIZE + PGB_LCD_X / 8;
+            playdate->system->logToConsole("Benchmark: %u instructions/s, %u ms/frame", (unsigned int)((uint64_t)context->gb.counter.instructions * 1000 / time), time / gameScene->debug_benchmarkFrames);
             
-            int row_offset = LCD_ROWSIZE;
-            int row_offset2 = LCD_ROWSIZE * 2;
+            #if PEANUT_GB_BLOCK_CACHE
+            struct gb_block_cache_s *cache = &context->block_cache;
+            playdate->system->logToConsole("Block cache: %u hits, %u misses, %u invalidations", cache->hits, cache->misses, cache->invalidations);
+            cache->hits = 0;
+            cache->misses = 0;
+            cache->invalidations = 0;
+            #endif
             
-            int y_offset;
-            int next_y_offset = 2;
+            context->gb.counter.instructions = 0;
+            gameScene->debug_benchmarkTime = 0;
+            gameScene->debug_benchmarkFrames = 0;
+        }
+        #endif
+        
+        // The core counts the frames skipped since the last one it drew
+        bool gb_drawn = (context->gb.display.frame_skip_count == 0);
+        
+        // Frames that are the same as the one on screen leave every line clean
+        int dirtyLines = 0;
+        
+        for(int i = 0; i < sizeof(context->gb.direct.line_dirty) / sizeof(context->gb.direct.line_dirty[0]); i++)
+        {
+            dirtyLines += __builtin_popcount(context->gb.direct.line_dirty[i]);
+        }
+        
+        bool gb_draw = (gb_drawn || needsDisplay);
+        
+        if(gb_drawn && preferences_frame_skip)
+        {
+            // When behind schedule, the frames that changed most are the ones not blitted.
+            // Their dirty lines are kept, so the next frame blits them too.
+            if(!needsDisplay && !frameSkip->deferred && frameSkip->lag > 0 && dirtyLines > frameSkip->dirtyLines * 1.25f)
+            {
+                gb_draw = false;
+                frameSkip->deferred = true;
+            }
+            else
+            {
+                frameSkip->deferred = false;
+            }
             
-            for(int y = 0; y < (LCD_HEIGHT - 1); y++)
+            frameSkip->dirtyLines += (dirtyLines - frameSkip->dirtyLines) * 0.1f;
+        }
+        
+        gameScene->scene->preferredRefreshRate = gb_draw ? 60 : 0;
+        gameScene->scene->refreshRateCompensation = gb_draw ? -frameSkip->lag : 0;
+        
+        if(gb_draw && (dirtyLines > 0 || needsDisplay))
+        {
+            uint8_t *framebuffer = playdate->graphics->getFrame();
+            
+            PGB_Scaler *scaler = &gameScene->scaler;
+            
+            for(int y = scaler->top; y < scaler->bottom; y++)
             {
-                y_offset = next_y_offset;
+                int line = scaler->rowMap[y];
                 
-                if(skip_counter == 5)
-                {
-                    y_offset = 1;
-                    next_y_offset = 1;
-                    skip_counter = 0;
-                    single_line = true;
-                }
-                else if(single_line)
+                if(line < 0)
                 {
-                    next_y_offset = 2;
-                    single_line = false;
+                    continue;
                 }
                 
-                uint8_t *pixels;
-                uint8_t *old_pixels;
+                // The core flags the lines it drew differently from the previous frame
+                bool line_dirty = context->gb.direct.line_dirty[line >> 5] & ((uint32_t)1 << (line & 31));
                 
-                if(context->gb.display.back_fb_enabled)
+                if(line_dirty || needsDisplay)
                 {
-                    pixels = gb_front_fb[y];
-                    old_pixels = gb_back_fb[y];
-                }
-                else
-                {
-                    pixels = gb_back_fb[y];
-                    old_pixels = gb_front_fb[y];
-                }
-                
-                if(memcmp(pixels, old_pixels, LCD_WIDTH) != 0)
-                {
-                    int d_row1 = y2 & 3;
-                    int d_row2 = (y2 + 1) & 3;
-                    
-                    int fb_index1 = lcd_rows;
-                    int fb_index2 = lcd_rows + row_offset;
+                    uint8_t *pixels = context->gb.display.back_fb_enabled ? gb_front_fb[line] : gb_back_fb[line];
                     
-                    memset(&framebuffer[fb_index1], 0x00, PGB_LCD_ROWSIZE);
-                    if(y_offset == 2)
-                    {
-                        memset(&framebuffer[fb_index2], 0x00, PGB_LCD_ROWSIZE);
-                    }
+                    scaler->drawRow(&framebuffer[y * LCD_ROWSIZE + scaler->x], pixels, y & 3);
                     
-                    uint8_t bit = 0;
+                    playdate->graphics->markUpdatedRows(y, y);
                     
-                    for(int x = 0; x < LCD_WIDTH; x++)
-                    {
-                        uint8_t pixel = pixels[x] & 3;
-                        
-                        framebuffer[fb_index1] |= PGB_bitmask[pixel][bit][d_row1];
-                        if(y_offset == 2)
-                        {
-                            framebuffer[fb_index2] |= PGB_bitmask[pixel][bit][d_row2];
-                        }
-                        
-                        bit++;
-                        
-                        if(bit == 4)
-                        {
-                            bit = 0;
-                            fb_index1++;
-                            fb_index2++;
-                        }
-                    }
-                    
-                    playdate->graphics->markUpdatedRows(y2, y2 + y_offset - 1);
-                        
                     #if PGB_DEBUG && PGB_DEBUG_UPDATED_ROWS
-                    for(int i = 0; i < y_offset; i++){
-                        context->scene->debug_updatedRows[y2 + i] = true;
-                    }
+                    context->scene->debug_updatedRows[y] = true;
                     #endif
                 }
-                
-                y2 += y_offset;
-                lcd_rows += (y_offset == 1) ? row_offset : row_offset2;
-                
-                if(!single_line)
-                {
-                    skip_counter++;
-                }
             }
+            
+            memset(context->gb.direct.line_dirty, 0, sizeof(context->gb.direct.line_dirty));
+        }
+        
+        if(preferences_frame_skip)
+        {
+            PGB_GameScene_updateFrameSkip(gameScene, playdate->system->getElapsedTime() - frameStart, gb_drawn);
         }
         
         const unsigned int rtc_delta_max = 60 * 60;
@@ -565,6 +645,13 @@ static void PGB_GameScene_update(void *object)
             rtc_tick++;
         }
         gameScene->rtc_time += rtc_delta;
+        
+        // The wide scaler draws over the crank selector, which still works without it
+        if(gameScene->scaler.coversSelector)
+        {
+            needsDisplay = false;
+            needsDisplaySelector = false;
+        }
 
         if(needsDisplay)
         {
@@ -703,15 +790,60 @@ static void PGB_GameScene_didSelectLibrary(void *userdata)
     PGB_present(libraryScene->scene);
 }
 
+static void PGB_GameScene_didChangeScaler(void *userdata)
+{
+    PGB_GameScene *gameScene = userdata;
+    
+    gameScene->preferences.scaler_mode = playdate->system->getMenuItemValue(gameScene->scalerMenuItem);
+    prefereces_save_game(gameScene->rom_filename, &gameScene->preferences);
+    
+    PGB_Scaler_init(&gameScene->scaler, gameScene->preferences.scaler_mode);
+    
+    // Clear what the previous mode drew
+    gameScene->needsDisplay = true;
+}
+
+static void PGB_GameScene_updateFrameSkip(PGB_GameScene *gameScene, float cost, bool drawn)
+{
+    PGB_FrameSkip *frameSkip = &gameScene->frameSkip;
+    
+    float *average = drawn ? &frameSkip->drawnCost : &frameSkip->skippedCost;
+    *average += (cost - *average) * 0.1f;
+    
+    // The fewest skipped frames that fit a drawn frame and the skipped ones in their time.
+    // Fewer frames are skipped only once they fit with some time left, so the choice doesn't flicker.
+    int currentSkip = gameScene->context->gb.direct.frame_skip;
+    int skip = 0;
+    
+    while(skip < PGB_FRAME_SKIP_MAX)
+    {
+        float budget = (skip + 1) * PGB_FRAME_TIME * (skip < currentSkip ? 0.8f : 0.9f);
+        
+        if(frameSkip->drawnCost + skip * frameSkip->skippedCost <= budget)
+        {
+            break;
+        }
+        
+        skip++;
+    }
+    
+    gameScene->context->gb.direct.frame_skip = skip;
+}
+
 static void PGB_GameScene_menu(void *object)
 {
     PGB_GameScene *gameScene = object;
     
+    // The previous items were removed before the menu is built again
+    gameScene->scalerMenuItem = NULL;
+    
     playdate->system->addMenuItem("Library", PGB_GameScene_didSelectLibrary, gameScene);
     
     if(gameScene->state == PGB_GameSceneStateLoaded)
     {
         playdate->system->addMenuItem("Save", PGB_GameScene_didSelectSave, gameScene);
+        gameScene->scalerMenuItem = playdate->system->addOptionsMenuItem("Scale", PGB_ScalerModeTitles, PGB_ScalerModeCount, PGB_GameScene_didChangeScaler, gameScene);
+        playdate->system->setMenuItemValue(gameScene->scalerMenuItem, gameScene->scaler.mode);
     }
 }
 
@@ -728,45 +860,272 @@ static void PGB_GameScene_saveGame(PGB_GameScene *gameScene)
     }
 }
 
-static void PGB_GameScene_generateBitmask(void)
+#if PGB_DEBUG && PGB_DEBUG_BENCHMARK
+static void PGB_GameScene_benchmarkError(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t val)
+{
+    playdate->system->logToConsole("%s:%i: Benchmark error %d (%#06x)", __FILE__, __LINE__, gb_err, val);
+}
+
+// Runs code from $0150 of an empty ROM, returns the time taken in ms or 0 on error
+static unsigned int PGB_GameScene_runBenchmark(const uint8_t *code, size_t size, int frames, unsigned int *instructions)
+{
+    unsigned int time = 0;
+    
+    uint8_t *rom = pgb_calloc(1, 0x8000);
+    uint8_t *wram = pgb_malloc(WRAM_SIZE);
+    uint8_t *vram = pgb_malloc(VRAM_SIZE);
+    struct gb_s *gb = pgb_malloc(sizeof(struct gb_s));
+    
+    #if PEANUT_GB_BLOCK_CACHE
+    struct gb_block_cache_s *cache = pgb_malloc(sizeof(struct gb_block_cache_s));
+    #endif
+    
+    // nop; jp $0150
+    rom[0x100] = 0x00;
+    rom[0x101] = 0xC3;
+    rom[0x102] = 0x50;
+    rom[0x103] = 0x01;
+    memcpy(&rom[0x150], code, size);
+    
+    uint8_t checksum = 0;
+    for(int i = 0x134; i <= 0x14C; i++)
+    {
+        checksum = checksum - rom[i] - 1;
+    }
+    rom[0x14D] = checksum;
+    
+    if(gb_init(gb, wram, vram, rom, PGB_GameScene_benchmarkError, NULL) == GB_INIT_NO_ERROR)
+    {
+        gb_init_lcd(gb);
+        
+        #if PEANUT_GB_BLOCK_CACHE
+        gb_init_block_cache(gb, cache);
+        #endif
+        
+        unsigned int start = playdate->system->getCurrentTimeMilliseconds();
+        
+        for(int i = 0; i < frames; i++)
+        {
+            gb_run_frame(gb);
+        }
+        
+        time = pgb_max(playdate->system->getCurrentTimeMilliseconds() - start, 1);
+        *instructions = gb->counter.instructions;
+        
+        #if PEANUT_GB_BLOCK_CACHE
+        playdate->system->logToConsole("Block cache: %u hits, %u misses, %u invalidations", cache->hits, cache->misses, cache->invalidations);
+        #endif
+    }
+    
+    #if PEANUT_GB_BLOCK_CACHE
+    pgb_free(cache);
+    #endif
+    pgb_free(gb);
+    pgb_free(vram);
+    pgb_free(wram);
+    pgb_free(rom);
+    
+    return time;
+}
+
+static void PGB_GameScene_opcodeBenchmark(void)
+{
+    // Turns the background off, then loops through ALU opcodes and flag tests
+    static const uint8_t code[] = {
+        0x3E, 0x80,             // ld a, $80
+        0xE0, 0x40,             // ldh (LCDC), a
+        0x80,                   // loop: add a, b
+        0x89,                   // adc a, c
+        0x92,                   // sub d
+        0x9B,                   // sbc a, e
+        0xBC,                   // cp h
+        0x2C,                   // inc l
+        0xC6, 0x11,             // add a, $11
+        0xD6, 0x07,             // sub $07
+        0xFE, 0x42,             // cp $42
+        0x3D,                   // dec a
+        0x04,                   // inc b
+        0x0C,                   // inc c
+        0x20, 0xEF,             // jr nz, loop
+        0x18, 0xED              // jr loop
+    };
+    unsigned int instructions;
+    unsigned int time = PGB_GameScene_runBenchmark(code, sizeof(code), 120, &instructions);
+    
+    if(time > 0)
+    {
+        playdate->system->logToConsole("Opcode benchmark: %u instructions in %u ms (%u instructions/s), lazy flags %s", instructions, time, (unsigned int)((uint64_t)instructions * 1000 / time), PEANUT_GB_LAZY_FLAGS ? "on" : "off");
+    }
+}
+
+static void PGB_GameScene_renderBenchmark(void)
 {
-    if(PGB_GameScene_bitmask_done)
+    // Fills tiles, maps and OAM with a pattern, then scrolls the background
+    // as fast as it can, so that no line is drawn from the same inputs twice
+    static const uint8_t code[] = {
+        0x21, 0x00, 0x80,       // ld hl, $8000
+        0x7D,                   // vram: ld a, l
+        0xAC,                   // xor h
+        0x22,                   // ld (hl+), a
+        0x7C,                   // ld a, h
+        0xFE, 0xA0,             // cp $A0
+        0x20, 0xF8,             // jr nz, vram
+        0x21, 0x00, 0xFE,       // ld hl, $FE00
+        0x7D,                   // oam: ld a, l
+        0x22,                   // ld (hl+), a
+        0x7D,                   // ld a, l
+        0xFE, 0xA0,             // cp $A0
+        0x20, 0xF9,             // jr nz, oam
+        0x3E, 0x40,             // ld a, $40
+        0xE0, 0x4A,             // ldh (WY), a
+        0x3E, 0x57,             // ld a, $57
+        0xE0, 0x4B,             // ldh (WX), a
+        0x3E, 0xF3,             // ld a, $F3
+        0xE0, 0x40,             // ldh (LCDC), a
+        0x21, 0x43, 0xFF,       // ld hl, SCX
+        0x34,                   // loop: inc (hl)
+        0x18, 0xFD              // jr loop
+    };
+    const int frames = 120;
+    unsigned int instructions;
+    unsigned int time = PGB_GameScene_runBenchmark(code, sizeof(code), frames, &instructions);
+    
+    if(time > 0)
     {
+        playdate->system->logToConsole("Render benchmark: %d frames in %u ms (%u frames/s), packed frame buffer %s", frames, time, (unsigned int)(frames * 1000 / time), PEANUT_GB_PACKED_FB ? "on" : "off");
+    }
+}
+
+static void PGB_GameScene_wramCodeBenchmark(void)
+{
+    // Turns the background off, then runs a loop from WRAM that writes a
+    // variable in the same 256 byte page as its code
+    static const uint8_t code[] = {
+        0x3E, 0x80,             // ld a, $80
+        0xE0, 0x40,             // ldh (LCDC), a
+        0x21, 0x00, 0xC0,       // ld hl, $C000
+        0x3E, 0x21, 0x22,       // $C000: ld hl, $C080
+        0x3E, 0x80, 0x22,
+        0x3E, 0xC0, 0x22,
+        0x3E, 0x34, 0x22,       // $C003: loop: inc (hl)
+        0x3E, 0x7E, 0x22,       // $C004: ld a, (hl)
+        0x3E, 0x80, 0x22,       // $C005: add a, b
+        0x3E, 0x47, 0x22,       // $C006: ld b, a
+        0x3E, 0x18, 0x22,       // $C007: jr loop
+        0x3E, 0xFA, 0x22,
+        0xC3, 0x00, 0xC0        // jp $C000
+    };
+    unsigned int instructions;
+    unsigned int time = PGB_GameScene_runBenchmark(code, sizeof(code), 120, &instructions);
+    
+    if(time > 0)
+    {
+        playdate->system->logToConsole("WRAM code benchmark: %u instructions in %u ms (%u instructions/s)", instructions, time, (unsigned int)((uint64_t)instructions * 1000 / time));
+    }
+}
+#endif
+
+#if PEANUT_GB_PROFILE
+static void PGB_GameScene_profilePrint(SDFile *file, const char *format, ...)
+{
+    char line[128];
+    
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    
+    if(len > 0)
+    {
+        playdate->file->write(file, line, (unsigned int)pgb_min(len, sizeof(line) - 1));
+    }
+}
+
+static int PGB_GameScene_compareSamples(const void *a, const void *b)
+{
+    const struct gb_profile_sample_s *sampleA = a;
+    const struct gb_profile_sample_s *sampleB = b;
+    
+    return (sampleA->count < sampleB->count) - (sampleA->count > sampleB->count);
+}
+
+// Writes the execution profile as text to profiles/<rom name>.txt
+static void PGB_GameScene_writeProfile(PGB_GameScene *gameScene)
+{
+    struct gb_s *gb = &gameScene->context->gb;
+    struct gb_profile_s *profile = &gameScene->context->profile;
+    
+    const char *name = strrchr(gameScene->rom_filename, '/');
+    name = name ? name + 1 : gameScene->rom_filename;
+    
+    char *filename;
+    playdate->file->mkdir("profiles");
+    playdate->system->formatString(&filename, "profiles/%s.txt", name);
+    
+    SDFile *file = playdate->file->open(filename, kFileWrite);
+    
+    if(file == NULL)
+    {
+        playdate->system->logToConsole("%s:%i: Can't write profile %s", __FILE__, __LINE__, filename);
+        pgb_free(filename);
         return;
     }
     
-    PGB_GameScene_bitmask_done = true;
+    uint64_t instructions = 0;
+    uint64_t cycles = 0;
     
-    for(int palette = 0; palette < 4; palette++)
+    for(int i = 0; i < 0x100; i++)
     {
-        for(int y = 0; y < 4; y++)
+        instructions += profile->op_count[i];
+        cycles += profile->op_cycles[i];
+    }
+    
+    PGB_GameScene_profilePrint(file, "PlayGB profile: %s\n", name);
+    PGB_GameScene_profilePrint(file, "instructions %llu\n", (unsigned long long)instructions);
+    PGB_GameScene_profilePrint(file, "cycles %llu\n", (unsigned long long)cycles);
+    PGB_GameScene_profilePrint(file, "halt cycles %llu\n", (unsigned long long)profile->halt_cycles);
+    PGB_GameScene_profilePrint(file, "idle skipped cycles %llu\n", (unsigned long long)gb->idle.skipped_cycles);
+    
+    PGB_GameScene_profilePrint(file, "\nopcode count cycles\n");
+    for(int i = 0; i < 0x100; i++)
+    {
+        if(profile->op_count[i] > 0)
         {
-            int x_offset = 0;
-            
-            for(int i = 0; i < 4; i++)
-            {
-                int mask = 0x00;
-                
-                for(int x = 0; x < 2; x++){
-                    if(PGB_patterns[palette][y][x_offset + x] == 1)
-                    {
-                        int n = i * 2 + x;
-                        mask |= (1 << (7 - n));
-                    }
-                }
-                
-                PGB_bitmask[palette][i][y] = mask;
-                
-                x_offset += 2;
-                
-                if(x_offset == 4)
-                {
-                    x_offset = 0;
-                }
-            }
+            PGB_GameScene_profilePrint(file, "%02X %llu %llu\n", i, (unsigned long long)profile->op_count[i], (unsigned long long)profile->op_cycles[i]);
         }
     }
+    
+    PGB_GameScene_profilePrint(file, "\ncb count\n");
+    for(int i = 0; i < 0x100; i++)
+    {
+        if(profile->cb_count[i] > 0)
+        {
+            PGB_GameScene_profilePrint(file, "%02X %llu\n", i, (unsigned long long)profile->cb_count[i]);
+        }
+    }
+    
+    PGB_GameScene_profilePrint(file, "\npage reads writes\n");
+    for(int i = 0; i < 0x10; i++)
+    {
+        PGB_GameScene_profilePrint(file, "%04X %llu %llu\n", i << 12, (unsigned long long)profile->reads[i], (unsigned long long)profile->writes[i]);
+    }
+    
+    // Most sampled first, unused slots last
+    qsort(profile->pc_samples, GB_PROFILE_PC_SLOTS, sizeof(struct gb_profile_sample_s), PGB_GameScene_compareSamples);
+    
+    PGB_GameScene_profilePrint(file, "\nbank:pc samples (1 every %d instructions, %u dropped)\n", GB_PROFILE_PC_PERIOD, profile->dropped_samples);
+    for(int i = 0; i < GB_PROFILE_PC_SLOTS && profile->pc_samples[i].count > 0; i++)
+    {
+        struct gb_profile_sample_s *sample = &profile->pc_samples[i];
+        PGB_GameScene_profilePrint(file, "%02X:%04X %u\n", sample->bank, sample->pc, sample->count);
+    }
+    
+    playdate->file->close(file);
+    
+    playdate->system->logToConsole("Profile written to %s", filename);
+    pgb_free(filename);
 }
+#endif
 
 static void PGB_GameScene_free(void *object)
 {
@@ -775,9 +1134,25 @@ static void PGB_GameScene_free(void *object)
     
     audioGameScene = NULL;
     
+    gameScene->scalerMenuItem = NULL;
+    
     PGB_Scene_free(gameScene->scene);
     
     PGB_GameScene_saveGame(gameScene);
+    
+    #if PGB_DEBUG
+    if(gameScene->state == PGB_GameSceneStateLoaded && context->gb.idle.loops > 0)
+    {
+        playdate->system->logToConsole("%s: skipped %u idle loops, %.1f s of emulated time", gameScene->rom_filename, context->gb.idle.loops, (double)context->gb.idle.skipped_cycles / DMG_CLOCK_FREQ);
+    }
+    #endif
+    
+    #if PEANUT_GB_PROFILE
+    if(gameScene->state == PGB_GameSceneStateLoaded)
+    {
+        PGB_GameScene_writeProfile(gameScene);
+    }
+    #endif
         
     gb_reset(&context->gb);
     
@@ -11,6 +11,8 @@
 #include <stdio.h>
 #include <math.h>
 #include "scene.h"
+#include "scaler.h"
+#include "preferences.h"
 
 typedef struct PGB_GameSceneContext PGB_GameSceneContext;
 typedef struct PGB_GameScene PGB_GameScene;
@@ -59,6 +61,18 @@ typedef struct {
     bool selectPressed;
 } PGB_CrankSelector;
 
+typedef struct {
+    // Seconds spent on frames drawn by the core (emulation and blit) and on skipped frames, smoothed
+    float drawnCost;
+    float skippedCost;
+    // Dirty lines of the frames drawn by the core, smoothed
+    float dirtyLines;
+    // Seconds behind the schedule of 60 frames per second
+    float lag;
+    // Whether the last frame drawn by the core was left for the next one to blit
+    bool deferred;
+} PGB_FrameSkip;
+
 typedef struct PGB_GameScene {
     PGB_Scene *scene;
     char *save_filename;
@@ -76,10 +90,24 @@ typedef struct PGB_GameScene {
     
     PGB_CrankSelector selector;
     
+    PGB_GamePreferences preferences;
+    PGB_Scaler scaler;
+    PDMenuItem *scalerMenuItem;
+    PGB_FrameSkip frameSkip;
+    
 #if PGB_DEBUG && PGB_DEBUG_UPDATED_ROWS
     PDRect debug_highlightFrame;
     bool debug_updatedRows[LCD_ROWS];
 #endif
+    
+#if PGB_DEBUG && PGB_DEBUG_BENCHMARK
+    unsigned int debug_benchmarkTime;
+    int debug_benchmarkFrames;
+#endif
+    
+#if PGB_DEBUG && PGB_DEBUG_AUDIO
+    int debug_audioFrames;
+#endif
 } PGB_GameScene;
 
 PGB_GameScene* PGB_GameScene_new(const char *rom_filename);
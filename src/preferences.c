@@ -8,6 +8,7 @@
 #include "preferences.h"
 
 static const int pref_version = 2;
+static const int game_pref_version = 1;
 
 static const char *pref_filename = "preferences.bin";
 static SDFile *pref_file;
@@ -76,6 +77,43 @@ void prefereces_save_to_disk(void)
     playdate->file->close(pref_file);
 }
 
+void prefereces_read_game(const char *rom_filename, PGB_GamePreferences *game_preferences)
+{
+    game_preferences->scaler_mode = 0;
+    
+    char *filename = pgb_game_preferences_filename(rom_filename);
+    
+    pref_file = playdate->file->open(filename, kFileReadData);
+    if(pref_file)
+    {
+        // read model version
+        prefereces_read_uint32();
+        
+        game_preferences->scaler_mode = prefereces_read_uint8();
+        
+        playdate->file->close(pref_file);
+    }
+    
+    pgb_free(filename);
+}
+
+void prefereces_save_game(const char *rom_filename, PGB_GamePreferences *game_preferences)
+{
+    char *filename = pgb_game_preferences_filename(rom_filename);
+    
+    pref_file = playdate->file->open(filename, kFileWrite);
+    if(pref_file)
+    {
+        prefereces_write_uint32(game_pref_version);
+        
+        prefereces_write_uint8(game_preferences->scaler_mode);
+        
+        playdate->file->close(pref_file);
+    }
+    
+    pgb_free(filename);
+}
+
 static uint8_t prefereces_read_uint8(void)
 {
     uint8_t buffer[1];
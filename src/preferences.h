@@ -15,9 +15,17 @@ extern bool preferences_sound_enabled;
 extern bool preferences_display_fps;
 extern bool preferences_frame_skip;
 
+// Preferences saved for each game
+typedef struct {
+    int scaler_mode;
+} PGB_GamePreferences;
+
 void prefereces_init(void);
 
 void prefereces_read_from_disk(void);
 void prefereces_save_to_disk(void);
 
+void prefereces_read_game(const char *rom_filename, PGB_GamePreferences *game_preferences);
+void prefereces_save_game(const char *rom_filename, PGB_GamePreferences *game_preferences);
+
 #endif /* preferences_h */
@@ -0,0 +1,173 @@
+//
+//  scaler.c
+//  PlayGB
+//
+
+#include "scaler.h"
+
+const char *PGB_ScalerModeTitles[PGB_ScalerModeCount] = {"Fit", "1:1", "Crop", "Wide"};
+
+// Screen bits for each packed byte of 4 pixels, per dither row
+static uint8_t PGB_Scaler_lut1x[4][256];
+static uint8_t PGB_Scaler_lut2x[4][256];
+// 2.5x: groups of 4 pixels start on even and odd groups of 10 columns
+static uint16_t PGB_Scaler_lut5x2[2][4][256];
+static bool PGB_Scaler_tables_done = false;
+
+static void PGB_Scaler_generateTables(void);
+static uint32_t PGB_Scaler_dither(int packed, int ditherRow, int column, const int widths[4]);
+
+static void PGB_Scaler_drawRow1x(uint8_t *row, const uint8_t *packed, int ditherRow);
+static void PGB_Scaler_drawRow2x(uint8_t *row, const uint8_t *packed, int ditherRow);
+static void PGB_Scaler_drawRow5x2(uint8_t *row, const uint8_t *packed, int ditherRow);
+
+void PGB_Scaler_init(PGB_Scaler *scaler, PGB_ScalerMode mode)
+{
+    PGB_Scaler_generateTables();
+    
+    if(mode < 0 || mode >= PGB_ScalerModeCount)
+    {
+        mode = PGB_ScalerModeFit;
+    }
+    
+    scaler->mode = mode;
+    scaler->top = 0;
+    scaler->bottom = LCD_ROWS;
+    scaler->coversSelector = false;
+    
+    for(int y = 0; y < LCD_ROWS; y++)
+    {
+        int line = -1;
+        
+        switch(mode)
+        {
+            case PGB_ScalerModeFit:
+            case PGB_ScalerModeStretch:
+                line = y * 3 / 5;
+                break;
+            case PGB_ScalerModeUnscaled:
+            {
+                int top = (LCD_ROWS - PGB_GB_HEIGHT) / 2;
+                if(y >= top && y < top + PGB_GB_HEIGHT)
+                {
+                    line = y - top;
+                }
+                break;
+            }
+            case PGB_ScalerModeCrop:
+                line = (y + (PGB_GB_HEIGHT * 2 - LCD_ROWS) / 2) / 2;
+                break;
+            default:
+                break;
+        }
+        
+        scaler->rowMap[y] = line;
+    }
+    
+    switch(mode)
+    {
+        case PGB_ScalerModeUnscaled:
+            scaler->top = (LCD_ROWS - PGB_GB_HEIGHT) / 2;
+            scaler->bottom = scaler->top + PGB_GB_HEIGHT;
+            scaler->x = (LCD_COLUMNS - PGB_GB_WIDTH) / 2 / 8;
+            scaler->drawRow = PGB_Scaler_drawRow1x;
+            break;
+        case PGB_ScalerModeStretch:
+            scaler->x = 0;
+            scaler->coversSelector = true;
+            scaler->drawRow = PGB_Scaler_drawRow5x2;
+            break;
+        default:
+            scaler->x = PGB_LCD_X / 8;
+            scaler->drawRow = PGB_Scaler_drawRow2x;
+            break;
+    }
+}
+
+static void PGB_Scaler_drawRow1x(uint8_t *row, const uint8_t *packed, int ditherRow)
+{
+    const uint8_t *lut = PGB_Scaler_lut1x[ditherRow];
+    
+    for(int x = 0; x < PGB_GB_WIDTH / 4; x += 2)
+    {
+        *row++ = (lut[packed[x]] << 4) | lut[packed[x + 1]];
+    }
+}
+
+static void PGB_Scaler_drawRow2x(uint8_t *row, const uint8_t *packed, int ditherRow)
+{
+    const uint8_t *lut = PGB_Scaler_lut2x[ditherRow];
+    
+    // Four bytes are converted at a time and stored as a word (little endian)
+    for(int x = 0; x < PGB_GB_WIDTH / 4; x += 4)
+    {
+        uint32_t bytes;
+        memcpy(&bytes, &packed[x], sizeof(bytes));
+        
+        uint32_t word = lut[bytes & 0xFF] | (lut[(bytes >> 8) & 0xFF] << 8) | (lut[(bytes >> 16) & 0xFF] << 16) | ((uint32_t)lut[bytes >> 24] << 24);
+        memcpy(&row[x], &word, sizeof(word));
+    }
+}
+
+static void PGB_Scaler_drawRow5x2(uint8_t *row, const uint8_t *packed, int ditherRow)
+{
+    const uint16_t *even = PGB_Scaler_lut5x2[0][ditherRow];
+    const uint16_t *odd = PGB_Scaler_lut5x2[1][ditherRow];
+    
+    // 16 pixels become 40 columns, which is 5 bytes
+    for(int x = 0; x < PGB_GB_WIDTH / 4; x += 4)
+    {
+        uint64_t bits = ((uint64_t)even[packed[x]] << 30) | ((uint64_t)odd[packed[x + 1]] << 20) | ((uint32_t)even[packed[x + 2]] << 10) | odd[packed[x + 3]];
+        
+        row[0] = bits >> 32;
+        row[1] = bits >> 24;
+        row[2] = bits >> 16;
+        row[3] = bits >> 8;
+        row[4] = bits;
+        row += 5;
+    }
+}
+
+static void PGB_Scaler_generateTables(void)
+{
+    if(PGB_Scaler_tables_done)
+    {
+        return;
+    }
+    
+    PGB_Scaler_tables_done = true;
+    
+    static const int widths1x[4] = {1, 1, 1, 1};
+    static const int widths2x[4] = {2, 2, 2, 2};
+    static const int widths5x2[4] = {3, 2, 3, 2};
+    
+    for(int y = 0; y < 4; y++)
+    {
+        for(int packed = 0; packed < 256; packed++)
+        {
+            PGB_Scaler_lut1x[y][packed] = PGB_Scaler_dither(packed, y, 0, widths1x);
+            PGB_Scaler_lut2x[y][packed] = PGB_Scaler_dither(packed, y, 0, widths2x);
+            PGB_Scaler_lut5x2[0][y][packed] = PGB_Scaler_dither(packed, y, 0, widths5x2);
+            PGB_Scaler_lut5x2[1][y][packed] = PGB_Scaler_dither(packed, y, 10, widths5x2);
+        }
+    }
+}
+
+// Screen bits for the 4 pixels of a packed byte, each drawn widths[i] columns wide from column
+static uint32_t PGB_Scaler_dither(int packed, int ditherRow, int column, const int widths[4])
+{
+    uint32_t bits = 0;
+    
+    for(int i = 0; i < 4; i++)
+    {
+        int palette = (packed >> (6 - 2 * i)) & 3;
+        
+        for(int n = 0; n < widths[i]; n++)
+        {
+            bits = (bits << 1) | PGB_patterns[palette][ditherRow][column & 3];
+            column++;
+        }
+    }
+    
+    return bits;
+}
@@ -0,0 +1,44 @@
+//
+//  scaler.h
+//  PlayGB
+//
+
+#ifndef scaler_h
+#define scaler_h
+
+#include <stdio.h>
+#include "utility.h"
+
+// Size of the Game Boy screen
+#define PGB_GB_WIDTH 160
+#define PGB_GB_HEIGHT 144
+
+typedef enum {
+    PGB_ScalerModeFit,      // 320x240, 3 lines to 5 rows
+    PGB_ScalerModeUnscaled, // 160x144, centered
+    PGB_ScalerModeCrop,     // 320x288, top and bottom 24 rows cropped
+    PGB_ScalerModeStretch,  // 400x240, 3 lines to 5 rows
+    PGB_ScalerModeCount
+} PGB_ScalerMode;
+
+extern const char *PGB_ScalerModeTitles[PGB_ScalerModeCount];
+
+typedef struct {
+    PGB_ScalerMode mode;
+    // Game Boy line drawn on each screen row, or -1
+    int16_t rowMap[LCD_ROWS];
+    // First screen row with a line, and the row after the last one
+    int top;
+    int bottom;
+    // Screen byte where each row starts
+    int x;
+    // Whether the screen is covered where the crank selector is drawn
+    bool coversSelector;
+    // Draws a packed line (4 pixels per byte, leftmost in bits 7-6) from
+    // byte x of a screen row, with the dither pattern of the row (y & 3)
+    void(*drawRow)(uint8_t *row, const uint8_t *packed, int ditherRow);
+} PGB_Scaler;
+
+void PGB_Scaler_init(PGB_Scaler *scaler, PGB_ScalerMode mode);
+
+#endif /* scaler_h */
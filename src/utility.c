@@ -11,6 +11,7 @@ PlaydateAPI *playdate;
 
 const char *PGB_savesPath = "saves";
 const char *PGB_gamesPath = "games";
+const char *PGB_preferencesPath = "preferences";
 
 const uint8_t PGB_patterns[4][4][4] = {
     {
@@ -46,9 +47,8 @@ char* string_copy(const char *string)
     return copied;
 }
 
-char* pgb_save_filename(const char *path, bool isRecovery)
+static char* pgb_filename_no_ext(const char *path)
 {
-    
     char *filename;
     
     char *slash = strrchr(path, '/');
@@ -77,6 +77,13 @@ char* pgb_save_filename(const char *path, bool isRecovery)
     strcpy(filenameNoExt, "");
     strncat(filenameNoExt, filename, len);
     
+    return filenameNoExt;
+}
+
+char* pgb_save_filename(const char *path, bool isRecovery)
+{
+    char *filenameNoExt = pgb_filename_no_ext(path);
+    
     char *suffix = "";
     if(isRecovery)
     {
@@ -91,6 +98,18 @@ char* pgb_save_filename(const char *path, bool isRecovery)
     return buffer;
 }
 
+char* pgb_game_preferences_filename(const char *path)
+{
+    char *filenameNoExt = pgb_filename_no_ext(path);
+    
+    char *buffer;
+    playdate->system->formatString(&buffer, "%s/%s.bin", PGB_preferencesPath, filenameNoExt);
+    
+    pgb_free(filenameNoExt);
+    
+    return buffer;
+}
+
 char* pgb_extract_fs_error_code(const char *fileError)
 {
     char *findStr = "uC-FS error: ";
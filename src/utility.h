@@ -16,6 +16,9 @@ extern PlaydateAPI *playdate;
 
 #define PGB_DEBUG 0
 #define PGB_DEBUG_UPDATED_ROWS 0
+#define PGB_DEBUG_BENCHMARK 0
+#define PGB_DEBUG_PROFILE 0
+#define PGB_DEBUG_AUDIO 0
 
 #define PGB_LCD_WIDTH 320
 #define PGB_LCD_HEIGHT 240
@@ -34,6 +37,7 @@ extern const uint8_t PGB_patterns[4][4][4];
 
 extern const char *PGB_savesPath;
 extern const char *PGB_gamesPath;
+extern const char *PGB_preferencesPath;
 
 char* string_copy(const char *string);
 
@@ -48,6 +52,7 @@ static inline int pgb_max(const int a, const int b)
 }
 
 char* pgb_save_filename(const char *filename, bool isRecovery);
+char* pgb_game_preferences_filename(const char *filename);
 char* pgb_extract_fs_error_code(const char *filename);
 PGB_HardwareRev pgb_get_hardware_rev(void);
 